@@ -0,0 +1,198 @@
+/*
+ * PrefixSkiplistSSet.h
+ *
+ * A SkiplistSSet that keeps P::of() of each key next to every pointer to
+ * it (see keyprefix.h), so that a search step compares integer prefixes
+ * and only looks at the key when they are equal.  Keys are constructed
+ * and destroyed in place, so T can be a string, and find(x) returns a
+ * pointer to the key it finds instead of a copy.
+ */
+
+#ifndef PREFIXSKIPLISTSSET_H_
+#define PREFIXSKIPLISTSSET_H_
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "keyprefix.h"
+
+namespace ods {
+
+template<class T, class P = fastws::KeyPrefix<T> >
+class PrefixSkiplistSSet {
+protected:
+	struct Node;
+	struct Link {
+		uint64_t pre;   // P::of(node->x), if node isn't NULL
+		Node *node;
+	};
+	struct Node {
+		uint64_t pre;   // P::of(x)
+		T x;
+		int height;     // length of next
+		Link next[];
+	};
+	Node *sentinel;
+	int h;
+	int n;
+	Node** stack;
+	size_t nties;   // comparisons that went to the keys
+
+	Node *newNode(int h);
+	void deleteNode(Node *u);
+	// compare the key in l.node, whose prefix is in l, to x
+	int compare(const Link &l, uint64_t px, const T &x) {
+		if (l.pre != px)
+			return (l.pre < px) ? -1 : 1;
+		nties++;
+		if (l.node->x < x) return -1;
+		if (x < l.node->x) return 1;
+		return 0;
+	}
+	static void link(Node *u, int r, Node *v) {
+		u->next[r].node = v;
+		u->next[r].pre = (v == NULL) ? 0 : v->pre;
+	}
+
+public:
+	PrefixSkiplistSSet();
+
+	virtual ~PrefixSkiplistSSet();
+
+	const T* find(const T &x);
+	bool remove(const T &x);
+	bool add(const T &x);
+	int pickHeight();
+	void clear();
+	int size() { return n;	}
+	size_t ties() { return nties; }
+};
+
+template<class T, class P>
+typename PrefixSkiplistSSet<T,P>::Node* PrefixSkiplistSSet<T,P>::newNode(int h) {
+	Node *u = (Node*)malloc(sizeof(Node)+(h+1)*sizeof(Link));
+	u->height = h;
+	return u;
+}
+
+template<class T, class P>
+void PrefixSkiplistSSet<T,P>::deleteNode(Node *u) {
+	u->x.~T();
+	free(u);
+}
+
+template<class T, class P>
+PrefixSkiplistSSet<T,P>::PrefixSkiplistSSet() {
+	n = 0;
+	nties = 0;
+	sentinel = newNode(sizeof(int)*8);
+	for (int r = 0; r <= sentinel->height; r++)
+		link(sentinel, r, NULL);
+	stack = new Node*[sentinel->height+1];
+	h = 0;
+}
+
+template<class T, class P>
+PrefixSkiplistSSet<T,P>::~PrefixSkiplistSSet() {
+	clear();
+	free(sentinel);  // its x was never constructed
+	delete[] stack;
+}
+
+template<class T, class P>
+const T* PrefixSkiplistSSet<T,P>::find(const T &x) {
+	uint64_t px = P::of(x);
+	Node *u = sentinel;
+	int r = h;
+	while (r >= 0) {
+		while (u->next[r].node != NULL && compare(u->next[r], px, x) < 0)
+			u = u->next[r].node; // go right in list r
+		r--; // go down into list r-1
+	}
+	return u->next[0].node == NULL ? NULL : &u->next[0].node->x;
+}
+
+template<class T, class P>
+bool PrefixSkiplistSSet<T,P>::remove(const T &x) {
+	uint64_t px = P::of(x);
+	bool removed = false;
+	Node *u = sentinel, *del = NULL;
+	int r = h;
+	int comp = 0;
+	while (r >= 0) {
+		while (u->next[r].node != NULL
+               && (comp = compare(u->next[r], px, x)) < 0) {
+			u = u->next[r].node;
+		}
+		if (u->next[r].node != NULL && comp == 0) {
+			removed = true;
+			del = u->next[r].node;
+			u->next[r] = del->next[r];
+			if (u == sentinel && u->next[r].node == NULL)
+				h--; // skiplist height has gone down
+		}
+		r--;
+	}
+	if (removed) {
+		deleteNode(del);
+		n--;
+	}
+	return removed;
+}
+
+template<class T, class P>
+bool PrefixSkiplistSSet<T,P>::add(const T &x) {
+	uint64_t px = P::of(x);
+	Node *u = sentinel;
+	int r = h;
+	int comp = 0;
+	while (r >= 0) {
+		while (u->next[r].node != NULL
+               && (comp = compare(u->next[r], px, x)) < 0)
+			u = u->next[r].node;
+		if (u->next[r].node != NULL && comp == 0)
+			return false;
+		stack[r--] = u;        // going down, store u
+	}
+	Node *w = newNode(pickHeight());
+	new (&w->x) T(x);
+	w->pre = px;
+	while (h < w->height)
+		stack[++h] = sentinel; // height increased
+	for (int i = 0; i <= w->height; i++) {
+		w->next[i] = stack[i]->next[i];
+		link(stack[i], i, w);
+	}
+	n++;
+	return true;
+}
+
+template<class T, class P>
+int PrefixSkiplistSSet<T,P>::pickHeight() {
+	int z = rand();
+	int k = 0;
+	int m = 1;
+	while ((z & m) != 0) {
+		k++;
+		m <<= 1;
+	}
+	return k;
+}
+
+template<class T, class P>
+void PrefixSkiplistSSet<T,P>::clear() {
+	Node *u = sentinel->next[0].node;
+	while (u != NULL) {
+		Node *n = u->next[0].node;
+		deleteNode(u);
+		u = n;
+	}
+	for (int r = 0; r <= h; r++)
+		link(sentinel, r, NULL);
+	h = 0;
+	n = 0;
+}
+
+} /* namespace ods */
+
+#endif /* PREFIXSKIPLISTSSET_H_ */
@@ -28,6 +28,9 @@ protected:
 	int n;
 	Node** stack;
 
+	// findMany(keys, out, m, g) interleaves at most gmax searches
+	static constexpr int gmax = 32;
+
 	Node *newNode(T x, int h);
 	void deleteNode(Node *u);
 	Node* findPredNode(T x);
@@ -38,6 +41,7 @@ public:
 	virtual ~SkiplistSSet();
 
 	T find(T x);
+	void findMany(const T *keys, T *out, size_t m, int g = 8);
 	bool remove(T x);
 	bool add(T x);
 	int pickHeight();
@@ -99,6 +103,49 @@ T SkiplistSSet<T>::find(T x) {
 	return u->next[0] == NULL ? null : u->next[0]->x;
 }
 
+/**
+ * Set out[j] = find(keys[j]) for j = 0,...,m-1.  Up to g searches run at
+ * once, taking turns, and each one prefetches the next node it will look at
+ * so that the cache misses of different searches overlap.
+ */
+template<class T>
+void SkiplistSSet<T>::findMany(const T *keys, T *out, size_t m, int g) {
+	Node *u[gmax];     // the search in slot s is at u[s]
+	int r[gmax];       // in list r[s], or idle if r[s] < 0
+	size_t idx[gmax];  // looking for keys[idx[s]]
+	if (g < 1) g = 1;
+	if (g > gmax) g = gmax;
+	for (int s = 0; s < g; s++)
+		r[s] = -1;
+
+	size_t j = 0;
+	bool busy = true;
+	while (busy) {
+		busy = false;
+		for (int s = 0; s < g; s++) {
+			if (r[s] < 0) {
+				if (j == m) continue;
+				idx[s] = j++;  // start the next search
+				u[s] = sentinel;
+				r[s] = h;
+			} else {
+				Node *w = u[s]->next[r[s]];
+				if (w != NULL && w->x < keys[idx[s]])
+					u[s] = w;  // go right in list r
+				else
+					r[s]--;    // go down into list r-1
+			}
+			busy = true;
+			if (r[s] >= 0) {
+				__builtin_prefetch(u[s]->next[r[s]]);
+			} else {
+				Node *w = u[s]->next[0];
+				out[idx[s]] = w == NULL ? null : w->x;
+			}
+		}
+	}
+}
+
 template<class T>
 bool SkiplistSSet<T>::remove(T x) {
 	bool removed = false;
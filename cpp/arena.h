@@ -0,0 +1,305 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * arena.h : A size-class arena for skiplist nodes
+ *
+ * All the nodes of a TodoList (or WSSkiplist) have the same size, so they
+ * can be carved out of a few large chunks instead of being malloc'd one at a
+ * time.  Blocks are handed out in the order they are requested, so nodes
+ * allocated during init() end up laid out in key order.  Freed blocks go on
+ * a free list and everything is released at once by reset() or the
+ * destructor.  reset() keeps the chunks around so that a global rebuild can
+ * reuse the same memory with a different block size, and trim() gives back
+ * the ones the rebuild didn't need, so the memory in use follows the number
+ * of elements as it shrinks as well as when it grows.  swap() and shrink()
+ * let a list copy its nodes into a new arena a few at a time and then give
+ * the old one back a chunk at a time.
+ *
+ * Chunks can optionally be backed by (transparent) huge pages.
+ */
+#ifndef FASTWS_ARENA_H_
+#define FASTWS_ARENA_H_
+
+#include <cstdlib>
+#include <cstddef>
+#include <cassert>
+#include <utility>
+
+#include <sys/mman.h>
+
+namespace fastws {
+
+class Arena {
+protected:
+	struct Chunk {
+		Chunk *next;  // chunks are kept in the order they were allocated
+		size_t size;  // total size of this chunk, including this header
+	};
+
+	// the first block of a chunk starts on a cache line, but blocks are
+	// only rounded up to a multiple of sizeof(void*), so the rest may not
+	static const size_t header = 64;
+	static const size_t min_chunk = 1 << 16;
+	static const size_t max_chunk = 1 << 26;
+	static const size_t huge_page = 1 << 21;
+
+	size_t bsize;   // the size of each block
+	bool huge;      // use huge pages for chunks?
+
+	Chunk *head, *tail;  // list of all chunks
+	Chunk *current;      // the chunk we are currently carving
+	char *cur, *end;     // free space in the current chunk
+	void *freelist;      // blocks returned by free()
+
+	// statistics
+	size_t reserved;     // total bytes in all chunks
+	size_t inuse;        // blocks currently handed out
+	size_t blocks;       // blocks ever handed out
+	size_t sysallocs;    // chunks ever requested from the system
+
+	Chunk *newChunk(size_t size);
+	void deleteChunk(Chunk *c);
+	void nextChunk();
+
+public:
+	Arena(size_t bsize0 = sizeof(void*), bool huge0 = false);
+	virtual ~Arena();
+	void *alloc();
+	void *allocRun(size_t count);
+	void free(void *p);
+	void reset(size_t bsize0);
+	void trim();
+	void clear();
+	bool shrink();
+	void swap(Arena &other);
+
+	size_t blockSize() { return bsize; }
+	size_t bytesReserved() { return reserved; }
+	size_t blocksInUse() { return inuse; }
+	size_t blockAllocations() { return blocks; }
+	size_t systemAllocations() { return sysallocs; }
+};
+
+inline Arena::Arena(size_t bsize0, bool huge0) {
+	huge = huge0;
+	head = tail = current = NULL;
+	cur = end = NULL;
+	reserved = inuse = blocks = sysallocs = 0;
+	bsize = 0;
+	reset(bsize0);
+}
+
+inline Arena::~Arena() {
+	clear();
+}
+
+inline Arena::Chunk* Arena::newChunk(size_t size) {
+	void *p;
+	if (huge) {
+		size = (size + huge_page - 1) / huge_page * huge_page;
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+				-1, 0);
+		if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(p, size, MADV_HUGEPAGE);
+#endif
+	} else {
+		if (posix_memalign(&p, header, size) != 0) return NULL;
+	}
+	sysallocs++;
+	reserved += size;
+	Chunk *c = (Chunk*)p;
+	c->next = NULL;
+	c->size = size;
+	return c;
+}
+
+inline void Arena::deleteChunk(Chunk *c) {
+	reserved -= c->size;
+	if (huge)
+		munmap(c, c->size);
+	else
+		std::free(c);
+}
+
+/**
+ * Move on to the next chunk, allocating it if we have run out
+ */
+inline void Arena::nextChunk() {
+	do {
+		if (current != NULL && current->next != NULL) {
+			current = current->next;
+			continue;
+		}
+		// grow geometrically so the number of chunks stays O(log n)
+		size_t size = tail == NULL ? min_chunk : tail->size * 2;
+		if (size > max_chunk) size = max_chunk;
+		while (size < header + bsize) size *= 2;
+		Chunk *c = newChunk(size);
+		assert(c != NULL);
+		if (tail == NULL)
+			head = c;
+		else
+			tail->next = c;
+		tail = current = c;
+	} while (current->size < header + bsize);
+	cur = (char*)current + header;
+	end = (char*)current + current->size;
+}
+
+inline void* Arena::alloc() {
+	void *p;
+	if (freelist != NULL) {
+		p = freelist;
+		freelist = *(void**)p;
+	} else {
+		if (cur == NULL || (size_t)(end - cur) < bsize)
+			nextChunk();
+		p = cur;
+		cur += bsize;
+	}
+	inuse++;
+	blocks++;
+	return p;
+}
+
+/**
+ * Return count consecutive blocks, from the first chunk that has room for
+ * them.  The chunks after current haven't been used since reset(), so on
+ * the way there we release any that are too small for the run, or more
+ * than four times too big, instead of leaving them behind.  If there are
+ * none left, the run gets a new chunk of its own.
+ */
+inline void* Arena::allocRun(size_t count) {
+	size_t size = count * bsize;
+	size_t need = header + size;
+	while (cur == NULL || (size_t)(end - cur) < size) {
+		Chunk *c = (current == NULL) ? head : current->next;
+		if (c == NULL) {
+			c = newChunk(need);
+			assert(c != NULL);
+			if (tail == NULL)
+				head = c;
+			else
+				tail->next = c;
+			tail = c;
+		} else if (c->size < need
+				|| c->size / 4 > (need > min_chunk ? need : min_chunk)) {
+			if (current == NULL)
+				head = c->next;
+			else
+				current->next = c->next;
+			if (tail == c)
+				tail = current;
+			deleteChunk(c);
+			continue;
+		}
+		current = c;
+		cur = (char*)c + header;
+		end = (char*)c + c->size;
+	}
+	void *p = cur;
+	cur += size;
+	inuse += count;
+	blocks += count;
+	return p;
+}
+
+inline void Arena::free(void *p) {
+	*(void**)p = freelist;
+	freelist = p;
+	inuse--;
+}
+
+/**
+ * Release every block at once and start handing out blocks of size bsize0,
+ * reusing the chunks we already have.
+ */
+inline void Arena::reset(size_t bsize0) {
+	const size_t align = sizeof(void*);
+	bsize = (bsize0 + align - 1) / align * align;
+	if (bsize < sizeof(void*)) bsize = sizeof(void*);
+	freelist = NULL;
+	inuse = 0;
+	current = NULL;
+	cur = end = NULL;
+	if (head != NULL) {
+		current = head;
+		cur = (char*)head + header;
+		end = (char*)head + head->size;
+	}
+}
+
+/**
+ * Give the chunks that haven't been used since reset() back to the system
+ */
+inline void Arena::trim() {
+	Chunk *c = (current == NULL) ? head : current->next;
+	while (c != NULL) {
+		Chunk *next = c->next;
+		deleteChunk(c);
+		c = next;
+	}
+	if (current == NULL)
+		head = NULL;
+	else
+		current->next = NULL;
+	tail = current;
+}
+
+/**
+ * Release every block and give all the memory back to the system
+ */
+inline void Arena::clear() {
+	while (head != NULL) {
+		Chunk *c = head;
+		head = head->next;
+		deleteChunk(c);
+	}
+	tail = current = NULL;
+	cur = end = NULL;
+	freelist = NULL;
+	inuse = 0;
+}
+
+/**
+ * Give the first chunk back to the system, which is one step of clear(), so
+ * it also releases every block.  Return false if there was none left.
+ */
+inline bool Arena::shrink() {
+	if (head == NULL)
+		return false;
+	Chunk *c = head;
+	head = head->next;
+	deleteChunk(c);
+	if (head == NULL)
+		tail = NULL;
+	current = NULL;
+	cur = end = NULL;
+	freelist = NULL;
+	inuse = 0;
+	return true;
+}
+
+/**
+ * Trade all our chunks and blocks for those of other
+ */
+inline void Arena::swap(Arena &other) {
+	std::swap(bsize, other.bsize);
+	std::swap(huge, other.huge);
+	std::swap(head, other.head);
+	std::swap(tail, other.tail);
+	std::swap(current, other.current);
+	std::swap(cur, other.cur);
+	std::swap(end, other.end);
+	std::swap(freelist, other.freelist);
+	std::swap(reserved, other.reserved);
+	std::swap(inuse, other.inuse);
+	std::swap(blocks, other.blocks);
+	std::swap(sysallocs, other.sysallocs);
+}
+
+} // fastws namespace
+
+#endif // FASTWS_ARENA_H_
@@ -0,0 +1,271 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * bgtodolist.h : A top-down skiplist that does global rebuilds in the
+ *                background
+ *
+ * A TodoList does a global rebuild, with one more level, every time its size
+ * crosses a power of (2-epsilon).  That rebuild takes O(n) time and is done
+ * inside add(x).  This wrapper instead freezes the current TodoList, main,
+ * when it fills up and builds its replacement on a helper thread.  While
+ * that happens, main is only read, and additions go into a small TodoList,
+ * delta.  When the helper is done, the new structure is swapped in, the old
+ * one is freed on the helper thread, and the elements of delta are copied
+ * over a few at a time by subsequent calls to add(x).  They stay in delta,
+ * which no longer changes, until it has all been copied and is thrown away.
+ * If main fills up again before then, delta is frozen along with main and
+ * merged by the helper.  main and delta are in incremental mode, so they
+ * don't do partial rebuilds on the spot either.
+ *
+ * - add(x) looks at O(log n) nodes in the worst case and never rebuilds
+ *   anything itself.
+ * - find(x) runs in O(log n) time and looks in main, delta and, while a
+ *   rebuild is running, the frozen delta.
+ *
+ * This only supports add(x) and find(x).
+ */
+#ifndef FASTWS_BGTODOLIST_H_
+#define FASTWS_BGTODOLIST_H_
+
+#include <thread>
+#include <atomic>
+
+#include "todolist.h"
+
+namespace fastws {
+
+template<class T>
+class BgTodoList {
+protected:
+	typedef typename TodoList<T>::Node Node;
+
+	// how many elements of delta are moved into main by each add(x)
+	static const int drain = 4;
+
+	double eps;
+	bool hugepages;
+
+	TodoList<T> *main;    // the main structure, frozen while building
+	TodoList<T> *delta;   // recent additions, the first moved of them in main
+	TodoList<T> *frozen;  // the old delta, frozen while building
+	TodoList<T> *next;    // the replacement for main, made by the helper
+
+	Node *drainAt;        // the next node of delta to copy into main
+	size_t moved;         // the number of nodes of delta before drainAt
+	size_t frozenMoved;   // the same for frozen
+
+	std::thread helper;
+	std::atomic<bool> done;
+	bool building;
+
+	// the number of global rebuilds so far, for printOn()
+	int rebuilds;
+
+	static void build(BgTodoList<T> *t);
+	static void discard(TodoList<T> *l1, TodoList<T> *l2);
+	TodoList<T> *newDelta();
+	void startRebuild();
+	void finishRebuild();
+	void moveSome();
+	bool contains(TodoList<T> *l, T x);
+	static Node* lesser(Node *u, Node *w);
+
+public:
+	BgTodoList(double eps0 = .4, bool hugepages0 = false);
+	virtual ~BgTodoList();
+	T find(T x);
+	bool add(T x);
+	size_t size() {
+		return main->size() + delta->size() - moved
+				+ (frozen == NULL ? 0 : frozen->size() - frozenMoved);
+	}
+	bool rebuilding() {
+		return building;
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class T>
+BgTodoList<T>::BgTodoList(double eps0, bool hugepages0) : done(false) {
+	eps = eps0;
+	hugepages = hugepages0;
+	main = new TodoList<T>(NULL, 0, eps, hugepages);
+	main->setIncremental(true);
+	delta = newDelta();
+	frozen = next = NULL;
+	drainAt = NULL;
+	moved = frozenMoved = 0;
+	building = false;
+	rebuilds = 0;
+}
+
+template<class T>
+BgTodoList<T>::~BgTodoList() {
+	if (helper.joinable())
+		helper.join();
+	delete main;
+	delete delta;
+	delete frozen;
+	delete next;
+}
+
+/**
+ * Runs on the helper thread: merge the (frozen) lists of main and frozen,
+ * which may have elements in common if delta was only partly moved, and
+ * build a new TodoList from the result.
+ */
+template<class T>
+void BgTodoList<T>::build(BgTodoList<T> *t) {
+	TodoList<T> *l1 = t->main, *l2 = t->frozen;
+	T *data = new T[l1->size() + l2->size()];
+	size_t enn = 0;
+	Node *u = l1->first();
+	Node *w = l2->first();
+	while (u != NULL || w != NULL) {
+		if (w == NULL || (u != NULL && u->x < w->x)) {
+			data[enn++] = u->x;
+			u = l1->after(u);
+		} else {
+			if (u != NULL && !(w->x < u->x))
+				u = l1->after(u);
+			data[enn++] = w->x;
+			w = l2->after(w);
+		}
+	}
+	t->next = new TodoList<T>(data, enn, t->eps, t->hugepages);
+	t->next->setIncremental(true);
+	delete[] data;
+	t->done.store(true, std::memory_order_release);
+}
+
+/**
+ * Runs on the helper thread: free the lists a rebuild replaced, which means
+ * giving back all the memory of the old main
+ */
+template<class T>
+void BgTodoList<T>::discard(TodoList<T> *l1, TodoList<T> *l2) {
+	delete l1;
+	delete l2;
+}
+
+template<class T>
+TodoList<T>* BgTodoList<T>::newDelta() {
+	TodoList<T> *l = new TodoList<T>(NULL, 0, eps);
+	l->setIncremental(true);
+	return l;
+}
+
+template<class T>
+void BgTodoList<T>::startRebuild() {
+	if (helper.joinable())
+		helper.join();  // done discarding the last ones long ago
+	frozen = delta;
+	frozenMoved = moved;
+	delta = newDelta();
+	drainAt = NULL;
+	moved = 0;
+	building = true;
+	done.store(false, std::memory_order_relaxed);
+	helper = std::thread(build, this);
+}
+
+template<class T>
+void BgTodoList<T>::finishRebuild() {
+	helper.join();
+	helper = std::thread(discard, main, frozen);
+	main = next;
+	frozen = next = NULL;
+	frozenMoved = 0;
+	drainAt = delta->first();
+	building = false;
+	rebuilds++;
+}
+
+/**
+ * Copy a few elements from delta into main, without filling main.  Taking
+ * them out of delta could mean rebuilding delta, so they stay there until
+ * the last one is copied, which find(x) and add(x) don't mind.
+ */
+template<class T>
+void BgTodoList<T>::moveSome() {
+	for (int c = 0; c < drain && drainAt != NULL && !main->full(); c++) {
+		main->add(drainAt->x);
+		drainAt = delta->after(drainAt);
+		moved++;
+	}
+	if (drainAt == NULL && moved > 0) {
+		delete delta;
+		delta = newDelta();
+		moved = 0;
+	}
+}
+
+template<class T>
+bool BgTodoList<T>::contains(TodoList<T> *l, T x) {
+	Node *w = l->walkNode(x);
+	return w != NULL && w->x == x;
+}
+
+template<class T>
+typename BgTodoList<T>::Node* BgTodoList<T>::lesser(Node *u, Node *w) {
+	if (u == NULL) return w;
+	if (w == NULL) return u;
+	return (w->x < u->x) ? w : u;
+}
+
+template<class T>
+T BgTodoList<T>::find(T x) {
+	Node *w = lesser(main->walkNode(x), delta->walkNode(x));
+	if (frozen != NULL)
+		w = lesser(w, frozen->walkNode(x));
+	return (w == NULL) ? (T)NULL : w->x;
+}
+
+template<class T>
+bool BgTodoList<T>::add(T x) {
+	if (building && done.load(std::memory_order_acquire))
+		finishRebuild();
+
+	if (!building) {
+		if (contains(delta, x))
+			return false;
+		if (!main->full()) {
+			bool added = main->add(x);
+			moveSome();
+			return added;
+		}
+		// main is full, so x goes to delta and main gets rebuilt
+		if (contains(main, x))
+			return false;
+		delta->add(x);
+		startRebuild();
+		return true;
+	}
+
+	// main and frozen are being read by the helper
+	if (contains(main, x) || contains(frozen, x))
+		return false;
+	return delta->add(x);
+}
+
+template<class T>
+void BgTodoList<T>::printOn(std::ostream &out) {
+	out << "BgTodoList: n = " << size() << " (rebuilt " << rebuilds
+		<< " times" << (building ? ", rebuilding" : "") << ")" << endl;
+	out << "main: ";
+	main->printOn(out);
+	out << "delta: ";
+	delta->printOn(out);
+}
+
+template<class T>
+ostream& operator<<(ostream &out, BgTodoList<T> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_BGTODOLIST_H_
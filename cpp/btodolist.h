@@ -0,0 +1,339 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * btodolist.h : A top-down skiplist of blocks (a B-skiplist)
+ *
+ * In a TodoList almost all the nodes are in the bottom list L_k and the
+ * levels just above it, so a search ends with a chain of dependent pointer
+ * hops into random cache lines.  In this variant, L_k is a list of blocks,
+ * each of which stores a sorted run of up to B consecutive keys in one or
+ * two cache lines.  The upper levels are the usual linked towers, built
+ * over the blocks using the first key in each block.  A search descends the
+ * towers with one comparison per level and then finishes with a binary
+ * search inside a single block.
+ *
+ * - add(x) runs in O(log n + B) amortized time; a full block is split in
+ *   two, and the new block is added to every level, just like a new node in
+ *   a TodoList.
+ * - find(x) runs in O(log n) worst-case time and performs
+ *   (1+epsilon)log(n/B) + log B + O(1) comparisons.
+ */
+#ifndef FASTWS_BTODOLIST_H_
+#define FASTWS_BTODOLIST_H_
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+#include <iostream>
+#include <algorithm>
+using namespace std;
+
+#include "arena.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+template<class T, int B = 16>
+class BTodoList {
+protected:
+	struct Node {
+		T x[B];       // a sorted run of keys
+		int m;        // the number of keys in x
+		Node *next[]; // a stack of next pointers
+	};
+
+	int k;    // there are k+1 lists numbered 0,...,k
+	int kmax; // k never gets bigger than this
+	size_t *n;   // n[i] is the number of blocks in the i'th list
+	size_t nkeys; // the total number of keys
+	Node *sentinel; // sentinel-next[i] is the first block of list i
+	Arena arena;    // where all the blocks come from
+
+	// parameters used to determine lists sizes
+	double eps;
+	size_t n0max;
+	size_t *a;
+
+	// scratch space for recording search paths
+	Node **path;
+
+	// rebuild_freqs[i] is the number of calls to rebuild(i), for printOn()
+	int *rebuild_freqs;
+
+	// how full init() makes each block
+	static const int fill = B - B/4;
+
+	void init(T *data, size_t n);
+	void rebuild();
+	void rebuild(int i);
+
+	Node *newNode();
+	void deleteNode(Node *u);
+	int search(Node *u, int lo, T x);
+
+public:
+	BTodoList(T *data = NULL, size_t n0 = 0, double eps0 = .4,
+			bool hugepages = false);
+	virtual ~BTodoList();
+	T find(T x);
+	bool add(T x);
+	size_t size() {
+		return nkeys;
+	}
+	size_t bytesUsed() {
+		return arena.bytesReserved() + sizeof(*this) + (k+1)*sizeof(size_t)
+				+ (kmax+1)*(sizeof(size_t) + sizeof(Node*) + sizeof(int));
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class T, int B>
+BTodoList<T,B>::BTodoList(T *data, size_t n0, double eps0, bool hugepages)
+		: arena(sizeof(Node), hugepages) {
+	eps = eps0;
+
+	kmax = maxLevel(eps);
+	rebuild_freqs = new int[kmax+1]();
+	path = new Node*[kmax+1];
+	a = new size_t[kmax+1];
+	setThresholds(a, kmax, eps);
+
+	init(data, n0);
+}
+
+template<class T, int B>
+void BTodoList<T,B>::init(T *data, size_t n0) {
+	n0max = 1;
+	size_t nb = (n0 + fill - 1) / fill;
+	k = max(0.0, ceil(log(nb) / log(2-eps)));
+	assert(k <= kmax);
+
+	n = new size_t[k + 1]();
+	n[k] = nb;
+	nkeys = n0;
+	// round blocks up to whole cache lines so that keys start on one
+	size_t bsize = sizeof(Node) + (k + 1) * sizeof(Node*);
+	arena.reset((bsize + 63) / 64 * 64);
+	sentinel = newNode();
+	Node *prev = sentinel;
+	for (size_t i = 0; i < n0; i += fill) {
+		Node *u = newNode();
+		u->m = min((size_t)fill, n0 - i);
+		for (int j = 0; j < u->m; j++)
+			u->x[j] = data[i+j];
+		prev->next[k] = u;
+		prev = u;
+	}
+	arena.trim();
+	rebuild(k);
+}
+
+template<class T, int B>
+typename BTodoList<T,B>::Node* BTodoList<T,B>::newNode() {
+	Node *u = (Node *) arena.alloc();
+	u->m = 0;
+	memset(u->next, '\0', (k + 1) * sizeof(Node*));
+	return u;
+}
+
+template<class T, int B>
+void BTodoList<T,B>::deleteNode(Node *u) {
+	arena.free(u);
+}
+
+template<class T, int B>
+void BTodoList<T,B>::rebuild() {
+	// time to rebuild --- free everything and start over
+	T *data = new T[nkeys];
+	size_t j = 0;
+	for (Node *u = sentinel->next[k]; u != NULL; u = u->next[k])
+		for (int t = 0; t < u->m; t++)
+			data[j++] = u->x[t];
+	assert(j == nkeys);
+	delete[] n;
+	init(data, j);
+	delete[] data;
+}
+
+template<class T, int B>
+void BTodoList<T,B>::rebuild(int i) {
+
+	rebuild_freqs[i]++;
+
+	for (int j = i - 1; j >= 0; j--) {
+		// populate L_j using L_{j+1}
+		n[j] = 0;
+		Node *u = sentinel->next[j + 1];
+		Node *prev = sentinel;
+		bool skipped = false;
+		while (u != NULL) {
+			if (skipped) {
+				prev->next[j] = u;
+				prev = u;
+				n[j]++;
+				skipped = false;
+			} else {
+				skipped = true;
+			}
+			u = u->next[j + 1];
+		}
+		prev->next[j] = NULL;
+	}
+
+}
+
+/**
+ * Return the index of the first key in u->x[lo..m-1] that is >= x,
+ * or u->m if there isn't one
+ */
+template<class T, int B>
+int BTodoList<T,B>::search(Node *u, int lo, T x) {
+	int hi = u->m;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (u->x[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+template<class T, int B>
+T BTodoList<T,B>::find(T x) {
+	Node *u = sentinel;
+	for (int i = 0; i <= k; i++) {
+		if (u->next[i] != NULL && u->next[i]->x[0] < x)
+			u = u->next[i];
+	}
+	// u->x[0] < x, so the answer is in u or is the first key of the next block
+	if (u != sentinel) {
+		int j = search(u, 1, x);
+		if (j < u->m)
+			return u->x[j];
+	}
+	Node *w = u->next[k];
+	return (w == NULL) ? T() : w->x[0];
+}
+
+template<class T, int B>
+bool BTodoList<T,B>::add(T x) {
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (u->next[i] != NULL && u->next[i]->x[0] < x)
+			u = u->next[i];
+		path[i] = u;
+	}
+
+	// x goes into block w
+	Node *w = u, *v;
+	if (u == sentinel) {
+		// x is smaller than everything, so it goes in the first block
+		w = sentinel->next[k];
+		for (i = 0; w != NULL && i <= k; i++)
+			path[i] = (sentinel->next[i] == w) ? w : sentinel;
+	}
+
+	if (w == NULL) {
+		// there are no blocks, so make one
+		v = newNode();
+		v->x[0] = x;
+		v->m = 1;
+	} else {
+		// check if x is already here and, if so, abort
+		int j = search(w, 0, x);
+		if (j < w->m && w->x[j] == x)
+			return false;
+		if (j == w->m && w->next[k] != NULL && w->next[k]->x[0] == x)
+			return false;
+
+		if (w->m < B) {
+			copy_backward(&w->x[j], &w->x[w->m], &w->x[w->m+1]);
+			w->x[j] = x;
+			w->m++;
+			nkeys++;
+			return true;
+		}
+
+		// w is full, so split it
+		v = newNode();
+		int h = B/2;
+		v->m = B - h;
+		w->m = h;
+		copy(&w->x[h], &w->x[B], v->x);
+		Node *z = (j <= h) ? w : v;
+		j = (j <= h) ? j : j - h;
+		copy_backward(&z->x[j], &z->x[z->m], &z->x[z->m+1]);
+		z->x[j] = x;
+		z->m++;
+	}
+	nkeys++;
+
+	// add the new block everywhere along the search path
+	for (i = k; i >= 0; i--) {
+		v->next[i] = path[i]->next[i];
+		path[i]->next[i] = v;
+		n[i]++;
+	}
+
+	// check if we need to add another level on the bottom
+	if (n[k] > a[k])
+		rebuild();
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T, int B>
+BTodoList<T,B>::~BTodoList() {
+	delete[] n;
+	delete[] a;
+	delete[] path;
+	delete[] rebuild_freqs;
+	// the arena frees all the blocks at once
+}
+
+template<class T, int B>
+void BTodoList<T,B>::printOn(std::ostream &out) {
+	const size_t max_print = 50;
+	cout << "BTodoList: n = " << nkeys << ", k = " << k << endl;
+	for (int i = 0; i <= k; i++) {
+		cout << "L(" << i << "): ";
+		if (nkeys <= max_print) {
+			Node *u = sentinel->next[i];
+			for (size_t j = 0; j < n[i]; j++) {
+				cout << "[";
+				for (int t = 0; t < u->m; t++)
+					cout << u->x[t] << (t < u->m-1 ? "," : "");
+				cout << "],";
+				u = u->next[i];
+			}
+			assert(u == NULL);
+		}
+		cout << " n(" << i << ") = " << n[i]
+		     << " (rebuilt " << rebuild_freqs[i] << " times)" << endl;
+	}
+}
+
+template<class T, int B>
+ostream& operator<<(ostream &out, BTodoList<T,B> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_BTODOLIST_H_
@@ -0,0 +1,378 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * compacttodolist.h : A top-down skiplist with variable-height towers
+ *
+ * A TodoList node has room for next pointers in every list, even though
+ * n[k-d] is about n/(2-eps)^d, so the average node is in fewer than three
+ * lists.  Here a node holds its key and its L_k pointer, and its pointers
+ * for the lists above L_k go in a separate tower, up[0], up[1], ..., for
+ * L_{k-1}, L_{k-2}, ...  Towers come from arenas whose block sizes are
+ * powers of two, so rebuild(i) can give a node a bigger (or smaller) tower
+ * without moving the node, and nothing that points at it has to change.
+ * A tower is only replaced when it is too small or four times too big.
+ *
+ * The price is one more load per list above L_k, since a search reads
+ * u->up and then the tower.
+ *
+ * - add(x) and remove(x) run in O(log n) amortized time.
+ * - find(x) runs in O(log n) worst-case time and performs
+ *   ceiling((1+epsilon)log n) comparisons.
+ */
+#ifndef FASTWS_COMPACTTODOLIST_H_
+#define FASTWS_COMPACTTODOLIST_H_
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+#include <iostream>
+#include <algorithm>
+using namespace std;
+
+#include "arena.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+template<class T>
+class CompactTodoList {
+protected:
+	struct Node {
+		T x;            // data
+		signed char c;  // up has room for 2^c pointers (c < 0 means none)
+		Node *next;     // the next node in L_k
+		Node **up;      // up[d-1] is the next node in L_{k-d}
+	};
+
+	int k;    // there are k+1 lists numbered 0,...,k
+	int kmax; // k never gets bigger than this
+	size_t *n;   // n[i] is the size of the i'th list
+	Node *sentinel; // the first element of list i comes after sentinel
+	Arena nodes;    // where all the nodes come from
+	int classes;    // towers[c] hands out towers of 2^c pointers
+	Arena *towers;
+
+	// parameters used to determine lists sizes
+	double eps;
+	size_t n0max;
+	size_t *a;
+
+	// scratch space for recording search paths
+	Node **path;
+
+	// rebuild_freqs[i] is the number of calls to rebuild(i), for printOn()
+	int *rebuild_freqs;
+
+	Node *getNext(Node *u, int i) {
+		return (i == k) ? u->next : u->up[k-i-1];
+	}
+	void setNext(Node *u, int i, Node *v) {
+		if (i == k)
+			u->next = v;
+		else
+			u->up[k-i-1] = v;
+	}
+	void resize(Node *u, int need, int keep);
+
+	void init(T *data, size_t n0);
+	void rebuild();
+	void rebuild(int i);
+
+	Node *newNode();
+	void deleteNode(Node *u);
+
+public:
+	CompactTodoList(T *data = NULL, size_t n0 = 0, double eps0 = .4);
+	virtual ~CompactTodoList();
+	T find(T x);
+	bool add(T x);
+	bool remove(T x);
+	size_t size() {
+		return n[k];
+	}
+	size_t bytesUsed();
+
+	void printOn(std::ostream &out);
+};
+
+template<class T>
+CompactTodoList<T>::CompactTodoList(T *data, size_t n0, double eps0)
+		: nodes(sizeof(Node)) {
+	eps = eps0;
+
+	kmax = maxLevel(eps);
+	rebuild_freqs = new int[kmax+1]();
+	path = new Node*[kmax+1];
+	n = new size_t[kmax+1]();
+	a = new size_t[kmax+1];
+	setThresholds(a, kmax, eps);
+
+	// a new node goes in every list, so it needs a tower of k <= kmax
+	for (classes = 1; (1 << (classes-1)) < kmax; classes++);
+	towers = new Arena[classes];
+
+	// the sentinel's tower is never resized, so it doesn't come from towers
+	sentinel = (Node*)malloc(sizeof(Node));
+	sentinel->c = -1;
+	sentinel->up = new Node*[kmax];
+
+	init(data, n0);
+}
+
+template<class T>
+void CompactTodoList<T>::init(T *data, size_t n0) {
+	n0max = 1;
+	k = max(0.0, ceil(log(n0) / log(2-eps)));
+	assert(k <= kmax);
+	fill(n, n + kmax + 1, 0);
+	n[k] = n0;
+
+	nodes.reset(sizeof(Node));
+	for (int c = 0; c < classes; c++)
+		towers[c].reset(sizeof(Node*) << c);
+	Node *prev = sentinel;
+	for (size_t i = 0; i < n0; i++) {
+		Node *u = newNode();
+		u->x = data[i];
+		prev->next = u;
+		prev = u;
+	}
+	prev->next = NULL;
+	nodes.trim();
+	rebuild(k);
+	for (int c = 0; c < classes; c++)
+		towers[c].trim();
+}
+
+template<class T>
+typename CompactTodoList<T>::Node* CompactTodoList<T>::newNode() {
+	Node *u = (Node *) nodes.alloc();
+	u->c = -1;
+	u->next = NULL;
+	u->up = NULL;
+	return u;
+}
+
+template<class T>
+void CompactTodoList<T>::deleteNode(Node *u) {
+	if (u->c >= 0)
+		towers[u->c].free(u->up);
+	nodes.free(u);
+}
+
+/**
+ * Make u's tower hold need pointers, keeping the first keep of them
+ */
+template<class T>
+void CompactTodoList<T>::resize(Node *u, int need, int keep) {
+	int cap = (u->c < 0) ? 0 : 1 << u->c;
+	if (need <= cap && 4*need > cap)
+		return;
+	int c = -1;
+	Node **up = NULL;
+	if (need > 0) {
+		for (c = 0; (1 << c) < need; c++);
+		up = (Node **) towers[c].alloc();
+		copy(u->up, u->up + min(keep, need), up);
+	}
+	if (u->c >= 0)
+		towers[u->c].free(u->up);
+	u->c = c;
+	u->up = up;
+}
+
+template<class T>
+void CompactTodoList<T>::rebuild() {
+	// time to rebuild --- free everything and start over
+	T *data = new T[n[k]];
+	Node *u = sentinel->next;
+	for (size_t j = 0; j < n[k]; j++) {
+		data[j] = u->x;
+		u = u->next;
+	}
+	init(data, n[k]);
+	delete[] data;
+}
+
+/**
+ * Rebuild L_0,...,L_{i-1} from L_i in one walk along L_i, as in
+ * TodoList::rebuild(i).  The node of rank r in L_i goes into L_{i-d} for
+ * every d such that 2^d divides r+1, so it ends up needing k-i+d tower
+ * pointers, of which the first k-i (for L_{k-1},...,L_i) stay as they are.
+ */
+template<class T>
+void CompactTodoList<T>::rebuild(int i) {
+	rebuild_freqs[i]++;
+	for (int j = 0; j < i; j++)
+		path[j] = sentinel;  // the last node of L_j so far
+	size_t t = 0;
+	Node *u = getNext(sentinel, i);
+	while (u != NULL) {
+		Node *v = getNext(u, i);
+		int d = min(i, __builtin_ctzll(++t));
+		resize(u, k - i + d, k - i);
+		for (int j = i - d; j < i; j++) {
+			setNext(path[j], j, u);
+			path[j] = u;
+		}
+		u = v;
+	}
+	for (int j = 0; j < i; j++) {
+		setNext(path[j], j, NULL);
+		n[j] = (i - j < 64) ? n[i] >> (i - j) : 0;
+	}
+}
+
+template<class T>
+T CompactTodoList<T>::find(T x) {
+	Node *u = sentinel;
+	for (int d = k - 1; d >= 0; d--) {
+		Node *w = u->up[d];
+		if (w != NULL && w->x < x)
+			u = w;
+	}
+	Node *w = u->next;
+	if (w != NULL && w->x < x)
+		w = w->next;
+	return (w == NULL) ? T() : w->x;
+}
+
+template<class T>
+bool CompactTodoList<T>::add(T x) {
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		Node *w = getNext(u, i);
+		if (w != NULL && w->x < x)
+			u = w;
+		path[i] = u;
+	}
+
+	// check if x is already here and, if so, abort
+	Node *w = u->next;
+	if (w != NULL && w->x == x)
+		return false;
+
+	// insert x everywhere along the search path
+	w = newNode();
+	w->x = x;
+	resize(w, k, 0);
+	for (i = k; i >= 0; i--) {
+		setNext(w, i, getNext(path[i], i));
+		setNext(path[i], i, w);
+		n[i]++;
+	}
+
+	// check if we need to add another level on the bottom
+	if (n[k] > a[k])
+		rebuild();
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T>
+bool CompactTodoList<T>::remove(T x) {
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		Node *w = getNext(u, i);
+		if (w != NULL && w->x < x)
+			u = w;
+		path[i] = u;
+	}
+
+	// check if x is here and, if not, abort
+	Node *w = u->next;
+	if (w == NULL || !(w->x == x))
+		return false;
+
+	// unlink w from every list it appears in
+	for (i = 0; i <= k; i++) {
+		if (getNext(path[i], i) == w) {
+			setNext(path[i], i, getNext(w, i));
+			n[i]--;
+		}
+	}
+	deleteNode(w);
+
+	// promote the second element of any L_i gap that got too big, as in
+	// TodoList::remove(), which takes one more pointer in its tower
+	for (i = k - 1; i >= 0; i--) {
+		Node *end = getNext(path[i], i);
+		Node *v = getNext(path[i], i+1);
+		if (v == end || getNext(v, i+1) == end)
+			continue;
+		v = getNext(v, i+1);
+		resize(v, k - i, k - i - 1);
+		setNext(v, i, end);
+		setNext(path[i], i, v);
+		n[i]++;
+	}
+
+	// check if we need to remove a level from the bottom
+	if (k > 1 && n[k] < a[k-2]) {
+		rebuild();
+		return true;
+	}
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T>
+size_t CompactTodoList<T>::bytesUsed() {
+	size_t bytes = nodes.bytesReserved() + sizeof(*this) + sizeof(Node)
+			+ kmax*sizeof(Node*)
+			+ (kmax+1)*(2*sizeof(size_t) + sizeof(Node*) + sizeof(int));
+	for (int c = 0; c < classes; c++)
+		bytes += towers[c].bytesReserved();
+	return bytes;
+}
+
+template<class T>
+CompactTodoList<T>::~CompactTodoList() {
+	delete[] n;
+	delete[] a;
+	delete[] path;
+	delete[] rebuild_freqs;
+	delete[] sentinel->up;
+	free(sentinel);
+	delete[] towers;
+	// the arenas free all the nodes and towers at once
+}
+
+template<class T>
+void CompactTodoList<T>::printOn(std::ostream &out) {
+	out << "CompactTodoList: n = " << n[k] << ", k = " << k << endl;
+	for (int i = 0; i <= k; i++)
+		out << " n(" << i << ") = " << n[i]
+		    << " (rebuilt " << rebuild_freqs[i] << " times)" << endl;
+}
+
+template<class T>
+ostream& operator<<(ostream &out, CompactTodoList<T> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_COMPACTTODOLIST_H_
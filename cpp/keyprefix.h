@@ -0,0 +1,77 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * keyprefix.h : Fixed-width integer prefixes of keys
+ *
+ * KeyPrefix<T>::of(x) is a 64-bit integer that orders like x does, but only
+ * partly: of(x) < of(y) implies x < y, so x < y implies of(x) <= of(y).  A
+ * search that keeps of(w->x) next to each pointer to w can settle most of
+ * its comparisons with one integer comparison on data it already has, and
+ * only looks at w->x itself when the prefixes are equal.
+ *
+ * For integer keys the prefix is the whole key, and P::exact says so: equal
+ * prefixes mean equal keys, and a search never has to look at the key.
+ * Then a tower entry is a copy of the key next to the pointer to it.
+ *
+ * NoKeyPrefix<T> makes every prefix equal, so every comparison goes to the
+ * key.  It is there to measure what the prefixes save.
+ */
+#ifndef FASTWS_KEYPREFIX_H_
+#define FASTWS_KEYPREFIX_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace fastws {
+
+template<class T>
+struct KeyPrefix;  // only defined for the keys below
+
+// an integer, with the sign bit flipped so that negative keys come first
+template<class T>
+struct IntKeyPrefix {
+	static const bool exact = true;
+	static uint64_t of(T x) {
+		uint64_t p = (uint64_t)(int64_t)x;
+		return std::is_signed<T>::value ? p ^ ((uint64_t)1 << 63) : p;
+	}
+};
+
+template<> struct KeyPrefix<int> : IntKeyPrefix<int> { };
+template<> struct KeyPrefix<long> : IntKeyPrefix<long> { };
+template<> struct KeyPrefix<long long> : IntKeyPrefix<long long> { };
+template<> struct KeyPrefix<unsigned> : IntKeyPrefix<unsigned> { };
+template<> struct KeyPrefix<unsigned long> : IntKeyPrefix<unsigned long> { };
+
+template<>
+struct KeyPrefix<std::string> {
+	static const bool exact = false;
+
+	// the first 8 bytes, the first one most significant, padded with zeros.
+	// string::compare() compares bytes as unsigned chars, so this orders
+	// the same way, except that a string and its zero-padded
+	// extensions tie.
+	static uint64_t of(const std::string &s) {
+		unsigned char b[8] = { 0 };
+		memcpy(b, s.data(), (s.size() < 8) ? s.size() : 8);
+		uint64_t p = 0;
+		for (int i = 0; i < 8; i++)
+			p = (p << 8) | b[i];
+		return p;
+	}
+};
+
+template<class T>
+struct NoKeyPrefix {
+	static const bool exact = false;
+	static uint64_t of(const T &) {
+		return 0;
+	}
+};
+
+} // fastws namespace
+
+#endif // FASTWS_KEYPREFIX_H_
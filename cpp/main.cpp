@@ -3,19 +3,42 @@
 #include <ctime>
 #include <iostream>
 #include <string>
+#include <sstream>
+#include <map>
+#include <set>
 #include <algorithm>
 #include <iterator>
+#include <numeric>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
 using namespace std;
 
 #include <unistd.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "SkiplistSSet.h"
+#include "PrefixSkiplistSSet.h"
 #include "Treap.h"
 #include "SplayTree.h"
 #include "RedBlackTree.h"
 #include "wsskiplist.h"
 #include "todolist.h"
 #include "todolist2.h"
+#include "todolist3.h"
+#include "compacttodolist.h"
+#include "prefixtodolist.h"
+#include "bgtodolist.h"
+#include "btodolist.h"
+#include "rcutodolist.h"
+#include "shardedtodolist.h"
+#include "todomap.h"
+#include "todosnapshot.h"
 
 
 // A silly class to use for simulating classes that have more expensive
@@ -108,6 +131,56 @@ int shuffle_data(size_t i, size_t n) {
 	return (i*sn + i/sn) % n;
 }
 
+// Key r comes up with probability proportional to about 1/r
+int zipf_data(size_t i, size_t n) {
+	return (int)pow(5.0*n, (double)rand() / RAND_MAX);
+}
+
+long rand_long() {
+	return ((long)rand() << 31) | rand();
+}
+
+// The time stamp counter, or nanoseconds where there isn't one
+unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Keys for maps, made from integers
+int int_key(int i) {
+	return i;
+}
+
+string string_key(int i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "key%08d", i);
+	return string(buf);
+}
+
+// keys of both signs
+long signed_key(int i) {
+	return (i % 2) ? -3L*i : 3L*i;
+}
+
+// keys whose first bytes are all over the place
+string word_key(int i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%016llx",
+			(unsigned long long)i * 0x9e3779b97f4a7c15ULL);
+	return string(buf);
+}
+
+// keys that only differ after a long common start
+string url_key(int i) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "https://example.com/item/%08d", i);
+	return string(buf);
+}
+
 template<class Dict>
 void build_and_search(Dict &d, const char *name, size_t n,
 		int (*gen_add)(size_t, size_t), int (*gen_search)(size_t, size_t)) {
@@ -144,6 +217,857 @@ void build_and_search(Dict &d, const char *name, size_t n,
 	summer += sum; // to make sure this isn't optimized away
 }
 
+// Measure the latencies of individual add(x) operations, and print the
+// worst one, how many took over a millisecond, and how many fall into each
+// of a series of buckets that double in width
+template<class Dict>
+void add_latency(Dict &d, const char *name, size_t n,
+		int (*gen_add)(size_t, size_t)) {
+	srand(1);
+	vector<double> times(n);
+	for (size_t i = 0; i < n; i++) {
+		int x = gen_add(i, n);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		d.add(x);
+		chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+		times[i] = chrono::duration<double, micro>(stop-start).count();
+	}
+	sort(times.begin(), times.end());
+	size_t stalls = times.end()
+			- upper_bound(times.begin(), times.end(), 1000.0);
+	cout << name << " LATENCY " << n << " " << times[n/2]
+			<< " " << times[n - n/1000 - 1] << " " << times[n-1]
+			<< " " << stalls << endl;
+	cout << name << " HISTOGRAM";
+	size_t j = 0;
+	for (double hi = .25; j < n; hi *= 2) {
+		size_t count = 0;
+		for (; j < n && times[j] < hi; j++)
+			count++;
+		cout << " <" << hi << ":" << count;
+	}
+	cout << endl;
+}
+
+void latency_suite(size_t n, int (*gen_data)(size_t, size_t)) {
+	cout << "Structure Operation n median p99.9 max (microseconds) "
+			<< "over-1ms" << endl;
+	cout << "Structure HISTOGRAM <bucket limit:count ..." << endl;
+	{
+		fastws::TodoList<Integer> tdl(NULL, 0, .2);
+		add_latency(tdl, "TodoList", n, gen_data);
+	}
+	{
+		fastws::TodoList<Integer> tdl(NULL, 0, .2);
+		tdl.setIncremental(true);
+		add_latency(tdl, "TodoList(incremental)", n, gen_data);
+	}
+	{
+		fastws::BgTodoList<Integer> tdl(.2);
+		add_latency(tdl, "BgTodoList", n, gen_data);
+	}
+}
+
+// Build big TodoLists from unsorted and sorted data and report time and
+// memory use
+void large_test(size_t n) {
+	cout << "Structure Operation n time bytes/element" << endl;
+	long *data = new long[n];
+	srand(1);
+	for (size_t i = 0; i < n; i++)
+		data[i] = rand_long() % (5*n);
+	{
+		// wall-clock time, since this uses all the cores
+		fastws::TodoList<long> tdl(NULL, 0, .2);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		tdl.bulkLoad(data, n);
+		chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+		double elapsed = chrono::duration<double>(stop-start).count();
+		double bpe = ((double)tdl.bytesUsed()) / tdl.size();
+		cout << "TodoList BULKLOAD " << n << " " << elapsed << " " << bpe
+				<< endl;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		data[i] = 5*i;
+	clock_t start = clock();
+	fastws::TodoList<long> tdl(data, n, .2);
+	clock_t stop = clock();
+	delete[] data;
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	double bpe = ((double)tdl.bytesUsed()) / tdl.size();
+	cout << "TodoList BUILD " << n << " " << elapsed << " " << bpe << endl;
+
+	size_t m = 1000000;
+	long sum = 0;
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		sum += tdl.find(rand_long() % (5*n));
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << "TodoList FIND " << m << " " << elapsed << " " << bpe << endl;
+
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		tdl.add(rand_long() % (5*n));
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	bpe = ((double)tdl.bytesUsed()) / tdl.size();
+	cout << "TodoList ADD " << m << " " << elapsed << " " << bpe << endl;
+
+	// the same again with a node layout that only stores the lists a node
+	// is actually in
+	data = new long[n];
+	for (size_t i = 0; i < n; i++)
+		data[i] = 5*i;
+	start = clock();
+	fastws::CompactTodoList<long> ctl(data, n, .2);
+	stop = clock();
+	delete[] data;
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	bpe = ((double)ctl.bytesUsed()) / ctl.size();
+	cout << "CompactTodoList BUILD " << n << " " << elapsed << " " << bpe
+			<< endl;
+
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		sum += ctl.find(rand_long() % (5*n));
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << "CompactTodoList FIND " << m << " " << elapsed << " " << bpe
+			<< endl;
+
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		ctl.add(rand_long() % (5*n));
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	bpe = ((double)ctl.bytesUsed()) / ctl.size();
+	cout << "CompactTodoList ADD " << m << " " << elapsed << " " << bpe
+			<< endl;
+
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// Add n random elements in sorted batches of size b, one at a time and with
+// addBatch
+void batch_suite(size_t n, size_t b) {
+	cout << "Structure Operation n time #comparisons" << endl;
+	vector<Integer> data(n);
+	srand(1);
+	for (size_t i = 0; i < n; i++)
+		data[i] = rand_data(i, n);
+	for (size_t i = 0; i < n; i += b)
+		sort(data.begin() + i, data.begin() + min(n, i + b));
+	{
+		fastws::TodoList<Integer> tdl(NULL, 0, .2);
+		Integer::resetComparisons();
+		clock_t start = clock();
+		for (size_t i = 0; i < n; i++)
+			tdl.add(data[i]);
+		clock_t stop = clock();
+		double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+		cout << "TodoList ADD " << n << " " << elapsed << " "
+				<< Integer::getComparisons() << endl;
+	}
+	{
+		fastws::TodoList<Integer> tdl(NULL, 0, .2);
+		Integer::resetComparisons();
+		clock_t start = clock();
+		for (size_t i = 0; i < n; i += b)
+			tdl.addBatch(data.begin() + i, data.begin() + min(n, i + b));
+		clock_t stop = clock();
+		double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+		cout << "TodoList ADDBATCH " << n << " " << elapsed << " "
+				<< Integer::getComparisons() << endl;
+	}
+}
+
+// Time m random finds done one at a time and with findMany(), for various
+// group sizes
+template<class Dict>
+void find_many(Dict &d, const char *name, size_t n, size_t m) {
+	vector<int> keys(m), out(m);
+	srand(2);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = rand() % (5*n);
+	long sum = 0;
+	clock_t start = clock();
+	for (size_t i = 0; i < m; i++)
+		sum += d.find(keys[i]);
+	clock_t stop = clock();
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << name << " FIND " << m << " " << elapsed << " "
+			<< m / elapsed << endl;
+	for (int g = 1; g <= 32; g *= 2) {
+		start = clock();
+		d.findMany(&keys[0], &out[0], m, g);
+		stop = clock();
+		elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+		cout << name << " FINDMANY(" << g << ") " << m << " " << elapsed
+				<< " " << m / elapsed << endl;
+		sum += out[m-1];
+	}
+	summer += sum; // to make sure this isn't optimized away
+}
+
+void find_many_suite(size_t n, size_t m) {
+	cout << "Structure Operation m time finds/second" << endl;
+	srand(1);
+	{
+		fastws::TodoList<int> tdl(NULL, 0, .2);
+		for (size_t i = 0; i < n; i++)
+			tdl.add(rand_data(i, n));
+		find_many(tdl, "TodoList", n, m);
+	}
+	{
+		fastws::TodoList2<int> tdl(NULL, 0, .2, INT_MAX);
+		for (size_t i = 0; i < n; i++)
+			tdl.add(rand_data(i, n));
+		find_many(tdl, "TodoList2", n, m);
+	}
+	{
+		ods::SkiplistSSet<int> sl;
+		for (size_t i = 0; i < n; i++)
+			sl.add(rand_data(i, n));
+		find_many(sl, "Skiplist", n, m);
+	}
+}
+
+// Look up a sorted batch of keys in a TodoList built from gen_data, one at a
+// time and with findSorted(), for dense batches (every element) and sparse
+// ones (m random keys)
+void find_sorted_suite(size_t n, size_t m, int (*gen_data)(size_t, size_t)) {
+	cout << "Structure Operation m time #comparisons" << endl;
+	srand(1);
+	fastws::TodoList<Integer> tdl(NULL, 0, .2);
+	for (size_t i = 0; i < n; i++)
+		tdl.add(gen_data(i, n));
+	vector<Integer> dense(n), sparse(m);
+	for (size_t i = 0; i < n; i++)
+		dense[i] = gen_data(i, n);
+	for (size_t i = 0; i < m; i++)
+		sparse[i] = rand_search(i, n);
+	sort(dense.begin(), dense.end());
+	sort(sparse.begin(), sparse.end());
+
+	vector<Integer> *batches[] = { &dense, &sparse };
+	const char *names[] = { "DENSE", "SPARSE" };
+	long sum = 0;
+	for (int b = 0; b < 2; b++) {
+		vector<Integer> &keys = *batches[b];
+		vector<Integer> out(keys.size());
+		Integer::resetComparisons();
+		clock_t start = clock();
+		for (size_t i = 0; i < keys.size(); i++)
+			sum += (int)tdl.find(keys[i]);
+		clock_t stop = clock();
+		double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+		cout << "TodoList FIND(" << names[b] << ") " << keys.size() << " "
+				<< elapsed << " " << Integer::getComparisons() << endl;
+
+		Integer::resetComparisons();
+		start = clock();
+		tdl.findSorted(&keys[0], &out[0], keys.size());
+		stop = clock();
+		elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+		cout << "TodoList FINDSORTED(" << names[b] << ") " << keys.size() << " "
+				<< elapsed << " " << Integer::getComparisons() << endl;
+		sum += (int)out[keys.size()-1];
+	}
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// Report the elements in m random ranges, each containing about w of them,
+// once by calling find(x) for each one and once with rangeScan()
+void range_suite(size_t n, size_t m, size_t w) {
+	cout << "Structure Operation m time #reported" << endl;
+	srand(1);
+	fastws::TodoList<int> tdl(NULL, 0, .2);
+	for (size_t i = 0; i < n; i++)
+		tdl.add(rand_data(i, n));
+	vector<int> lo(m);
+	for (size_t i = 0; i < m; i++)
+		lo[i] = rand_search(i, n);
+	long sum = 0;
+	size_t count = 0;
+	clock_t start = clock();
+	for (size_t i = 0; i < m; i++) {
+		int hi = lo[i] + 5*w;
+		for (int x = tdl.find(lo[i]); x != 0 && x < hi; x = tdl.find(x+1)) {
+			sum += x;
+			count++;
+		}
+	}
+	clock_t stop = clock();
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << "TodoList FINDS " << m << " " << elapsed << " " << count << endl;
+
+	count = 0;
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		count += tdl.rangeScan(lo[i], lo[i] + 5*w,
+				[&sum](int x) { sum += x; });
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << "TodoList RANGESCAN " << m << " " << elapsed << " " << count
+			<< endl;
+
+	count = 0;
+	start = clock();
+	for (size_t i = 0; i < m; i++) {
+		int hi = lo[i] + 5*w;
+		for (fastws::TodoList<int>::Iterator it = tdl.lowerBound(lo[i]);
+				it != tdl.end() && *it < hi; ++it) {
+			sum += *it;
+			count++;
+		}
+	}
+	stop = clock();
+	elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << "TodoList ITERATOR " << m << " " << elapsed << " " << count
+			<< endl;
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// Look up m random keys, half of them present, in maps of n keys made by
+// key(), and report the time and the number of hits
+template<class K, class Map>
+void map_lookups(Map &d, const char *name, size_t n, size_t m,
+		K (*key)(int)) {
+	vector<K> keys(m);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = key(rand() % (2*n));
+	size_t hits = 0;
+	long sum = 0;
+	clock_t start = clock();
+	for (size_t i = 0; i < m; i++) {
+		const int *v = d.get(keys[i]);
+		if (v != NULL) {
+			sum += *v;
+			hits++;
+		}
+	}
+	clock_t stop = clock();
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << name << " GET " << m << " " << elapsed << " " << hits << endl;
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// std::map with TodoMap's get()
+template<class K>
+class StdMap : public map<K, int> {
+public:
+	const int* get(const K &x) {
+		typename map<K, int>::iterator it = this->find(x);
+		return (it == this->end()) ? NULL : &it->second;
+	}
+};
+
+// The old way of making a map out of a TodoList: the value goes in the low
+// bits of the key
+class PackedTodoList : public fastws::TodoList<long> {
+	int v;
+public:
+	PackedTodoList() : fastws::TodoList<long>(NULL, 0, .2) { }
+	const int* get(int x) {
+		long y = find((long)x << 32);
+		if (y == 0 || (y >> 32) != x)
+			return NULL;
+		v = (int)y;
+		return &v;
+	}
+};
+
+void map_suite(size_t n, size_t m) {
+	cout << "Structure Operation m time #hits" << endl;
+	{
+		srand(1);
+		fastws::TodoMap<int, int> tm(.2);
+		for (size_t i = 0; i < n; i++)
+			tm.insertOrAssign(2*(rand() % n), i);
+		map_lookups(tm, "TodoMap<int>", n, m, int_key);
+	}
+	{
+		srand(1);
+		PackedTodoList tdl;
+		for (size_t i = 0; i < n; i++)
+			tdl.add(((long)(2*(rand() % n)) << 32) | i);
+		map_lookups(tdl, "PackedTodoList<long>", n, m, int_key);
+	}
+	{
+		srand(1);
+		StdMap<int> sm;
+		for (size_t i = 0; i < n; i++)
+			sm[2*(rand() % n)] = i;
+		map_lookups(sm, "std::map<int>", n, m, int_key);
+	}
+	{
+		srand(1);
+		fastws::TodoMap<string, int> tm(.2);
+		for (size_t i = 0; i < n; i++)
+			tm.insertOrAssign(string_key(2*(rand() % n)), i);
+		map_lookups(tm, "TodoMap<string>", n, m, string_key);
+	}
+	{
+		srand(1);
+		StdMap<string> sm;
+		for (size_t i = 0; i < n; i++)
+			sm[string_key(2*(rand() % n))] = i;
+		map_lookups(sm, "std::map<string>", n, m, string_key);
+	}
+}
+
+// std::set with the find() of the prefix structures, counting comparisons
+struct CountingLess {
+	static size_t count;
+	bool operator()(const string &a, const string &b) const {
+		count++;
+		return a < b;
+	}
+};
+size_t CountingLess::count;
+
+class StdSet : public set<string, CountingLess> {
+public:
+	bool add(const string &x) {
+		return insert(x).second;
+	}
+	const string* find(const string &x) {
+		iterator it = lower_bound(x);
+		return (it == end()) ? NULL : &*it;
+	}
+	size_t ties() {
+		return CountingLess::count;
+	}
+};
+
+// Add n keys made by key() and look up m random ones, about half of them
+// present, and report the time and the comparisons per find that had to
+// look at the keys themselves
+template<class Set>
+void prefix_lookups(Set &d, const char *name, const char *kind, size_t n,
+		size_t m, string (*key)(int)) {
+	srand(1);
+	for (size_t i = 0; i < n; i++)
+		d.add(key(2*(rand() % n)));
+	vector<string> keys(m);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = key(rand() % (2*n));
+	size_t ties = d.ties(), found = 0;
+	clock_t start = clock();
+	for (size_t i = 0; i < m; i++)
+		found += (d.find(keys[i]) != NULL);
+	clock_t stop = clock();
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	cout << name << " " << kind << " FIND " << m << " " << elapsed << " "
+			<< ((double)(d.ties() - ties)) / m << endl;
+	summer += found;
+}
+
+// Finds on string keys, with and without the prefixes in the towers
+void prefix_suite(size_t n, size_t m) {
+	cout << "Structure Keys Operation m time key-comparisons/find" << endl;
+	string (*const keys[])(int) = { word_key, string_key, url_key };
+	const char *kinds[] = { "word", "key%08d", "url" };
+	typedef fastws::NoKeyPrefix<string> NoPrefix;
+	for (int j = 0; j < 3; j++) {
+		{
+			fastws::PrefixTodoList<string> d(.2);
+			prefix_lookups(d, "PrefixTodoList", kinds[j], n, m, keys[j]);
+		}
+		{
+			fastws::PrefixTodoList<string, NoPrefix> d(.2);
+			prefix_lookups(d, "PrefixTodoList(no-prefix)", kinds[j], n, m,
+					keys[j]);
+		}
+		{
+			ods::PrefixSkiplistSSet<string> d;
+			prefix_lookups(d, "PrefixSkiplistSSet", kinds[j], n, m, keys[j]);
+		}
+		{
+			ods::PrefixSkiplistSSet<string, NoPrefix> d;
+			prefix_lookups(d, "PrefixSkiplistSSet(no-prefix)", kinds[j], n, m,
+					keys[j]);
+		}
+		{
+			StdSet d;
+			prefix_lookups(d, "std::set", kinds[j], n, m, keys[j]);
+		}
+	}
+}
+
+// Report the cycles per find(x) for m random keys in d, which holds n
+// random keys
+template<class Dict>
+void find_cycles(Dict &d, const char *name, size_t n, size_t m) {
+	srand(1);
+	for (size_t i = 0; i < n; i++)
+		d.add(rand_data(i, n));
+	vector<int> keys(m);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = rand_search(i, n);
+	long sum = 0;
+	unsigned long long start = cycles();
+	for (size_t i = 0; i < m; i++)
+		sum += d.find(keys[i]);
+	unsigned long long stop = cycles();
+	cout << name << " FIND " << n << " " << (double)(stop-start)/m << endl;
+	summer += sum; // to make sure this isn't optimized away
+}
+
+void unrolled_suite(size_t m) {
+	cout << "Structure Operation n cycles/find" << endl;
+	for (size_t n = 1000; n <= 1000000; n *= 10) {
+		{
+			fastws::TodoList<int> tdl(NULL, 0, .4);
+			find_cycles(tdl, "TodoList", n, m);
+		}
+		{
+			fastws::TodoList2<int> tdl(NULL, 0, .4, INT_MAX);
+			find_cycles(tdl, "TodoList2", n, m);
+		}
+		{
+			fastws::TodoList3<int, 40> tdl;
+			find_cycles(tdl, "TodoList3", n, m);
+		}
+	}
+}
+
+// Compare rebuilding a TodoList from a dump of its n elements with add(x)
+// to saving it as a snapshot and mapping that back in
+void snapshot_suite(size_t n, size_t m) {
+	const char *path = "/tmp/fastws-suite.snap";
+	cout << "Structure Operation n time" << endl;
+	srand(1);
+	vector<int> dump(n);
+	for (size_t i = 0; i < n; i++)
+		dump[i] = rand_data(i, n);
+	vector<int> keys(m);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = rand_search(i, n);
+	long sum = 0;
+
+	clock_t start = clock();
+	fastws::TodoList<int> tdl;
+	for (size_t i = 0; i < n; i++)
+		tdl.add(dump[i]);
+	clock_t stop = clock();
+	cout << "TodoList ADD " << n << " "
+			<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+
+	start = clock();
+	for (size_t i = 0; i < m; i++)
+		sum += tdl.find(keys[i]);
+	stop = clock();
+	cout << "TodoList FIND " << m << " "
+			<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+
+	start = clock();
+	bool ok = fastws::TodoSnapshot<int>::save(tdl, path);
+	stop = clock();
+	assert(ok);
+	cout << "TodoSnapshot SAVE " << n << " "
+			<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+	{
+		start = clock();
+		fastws::TodoSnapshot<int> snap(path);
+		stop = clock();
+		assert(snap.isOpen());
+		cout << "TodoSnapshot OPEN " << n << " "
+				<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+
+		start = clock();
+		for (size_t i = 0; i < m; i++)
+			sum += snap.find(keys[i]);
+		stop = clock();
+		cout << "TodoSnapshot FIND " << m << " "
+				<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+
+		start = clock();
+		snap.todoList();
+		stop = clock();
+		cout << "TodoSnapshot THAW " << n << " "
+				<< ((double)(stop-start))/CLOCKS_PER_SEC << endl;
+	}
+	fastws::TodoSnapshot<int>::unlink(path);
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// A TodoList behind a mutex, to compare with RcuTodoList
+class LockedTodoList {
+public:
+	fastws::TodoList<int> l;
+	std::mutex m;
+	class Reader {
+		LockedTodoList *d;
+	public:
+		Reader(LockedTodoList &d0) : d(&d0) { }
+		int find(int x) {
+			lock_guard<mutex> g(d->m);
+			return d->l.find(x);
+		}
+	};
+	bool add(int x) {
+		lock_guard<mutex> g(m);
+		return l.add(x);
+	}
+	bool remove(int x) {
+		lock_guard<mutex> g(m);
+		return l.remove(x);
+	}
+};
+
+// s as a line of JSON
+string statsJson(const fastws::Stats &s) {
+	ostringstream out;
+	s.printJson(out);
+	return out.str();
+}
+
+int compare_ints(const int &x, const int &y) {
+	return (x > y) - (x < y);
+}
+
+// Print the stats of each structure, as JSON, after n random additions
+// (or n elements to start with) and m Zipf-distributed finds
+void stats_suite(size_t n, size_t m) {
+	vector<int> data(n);
+	for (size_t i = 0; i < n; i++)
+		data[i] = 2*i;
+	{
+		fastws::TodoList<int> tdl(NULL, 0, .2);
+		for (size_t i = 0; i < n; i++)
+			tdl.add(rand_data(i, n));
+		for (size_t i = 0; i < m; i++)
+			summer += tdl.find(2*(zipf_data(i, n) % n));
+		cout << statsJson(tdl.stats()) << endl;
+	}
+	{
+		fastws::TodoList2<int> tdl(NULL, 0, .2, INT_MAX);
+		for (size_t i = 0; i < n; i++)
+			tdl.add(rand_data(i, n));
+		for (size_t i = 0; i < m; i++)
+			summer += tdl.find(2*(zipf_data(i, n) % n));
+		cout << statsJson(tdl.stats()) << endl;
+	}
+	{
+		fastws::WSSkiplist<int> wsl(&data[0], n, compare_ints, .2);
+		for (size_t i = 0; i < m; i++)
+			summer += wsl.find(2*(zipf_data(i, n) % n));
+		cout << statsJson(wsl.stats()) << endl;
+	}
+}
+
+// Random finds and additions, with a fraction r of finds, into TodoLists
+// with fixed eps and one that picks its own.  Integer::setDelay() makes
+// the comparisons more expensive.
+void tune_suite(size_t n) {
+	cout << "Structure delay finds time final-eps" << endl;
+	const double epss[] = { 0, .05, .2, .4, .8 };  // 0 means auto-tuned
+	const double rs[] = { .1, .9 };
+	for (size_t delay = 0; delay <= 200; delay += 200) {
+		Integer::setDelay(delay);
+		for (int j = 0; j < 2; j++) {
+			for (int e = 0; e < 5; e++) {
+				fastws::TodoList<Integer> tdl(NULL, 0, epss[e] ? epss[e] : .2);
+				if (epss[e] == 0)
+					tdl.setAutoTune(true);
+				srand(13);
+				clock_t start = clock();
+				for (size_t i = 0; i < n; i++) {
+					if (rand() % 100 < 100 * rs[j])
+						summer += tdl.find(rand_data(i, n));
+					else
+						tdl.add(rand_data(i, n));
+				}
+				clock_t stop = clock();
+				double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+				cout << "TodoList(eps=";
+				if (epss[e] == 0)
+					cout << "auto";
+				else
+					cout << epss[e];
+				cout << ") " << delay << " " << rs[j] << " " << elapsed
+						<< " " << tdl.stats().eps << endl;
+			}
+		}
+	}
+	Integer::setDelay(0);
+}
+
+// find(x) returns a key or a pointer to one, depending on the structure
+long found(long x) {
+	return x;
+}
+long found(const long *x) {
+	return (x == NULL) ? 0 : *x;
+}
+
+// Look up each of keys in d and report the time, the cycles and the cache
+// lines read per find (the last only with -DFASTWS_STATS)
+template<class Dict, class K>
+void inline_finds(Dict &d, const char *name, const vector<K> &keys) {
+	size_t m = keys.size();
+	d.resetStats();
+	long sum = 0;
+	clock_t start = clock();
+	unsigned long long c0 = cycles();
+	for (size_t i = 0; i < m; i++)
+		sum += found(d.find(keys[i]));
+	unsigned long long c1 = cycles();
+	clock_t stop = clock();
+	double elapsed = ((double)(stop-start))/CLOCKS_PER_SEC;
+	fastws::Stats s = d.stats();
+	cout << name << " FIND " << m << " " << elapsed << " "
+			<< (double)(c1-c0)/m << " " << s.linesPerFind() << " "
+			<< (double)s.bytesUsed / s.n << endl;
+	summer += sum; // to make sure this isn't optimized away
+}
+
+// Finds on n keys, with and without copies of the keys in the towers
+void inline_suite(size_t n, size_t m) {
+	cout << "Structure Operation m time cycles/find lines/find bytes/element"
+			<< endl;
+	vector<long> keys(m);
+	srand(1);
+	for (size_t i = 0; i < m; i++)
+		keys[i] = 2*(rand() % n) - (i % 2);
+	{
+		vector<long> data(n);
+		for (size_t i = 0; i < n; i++)
+			data[i] = 2*i;
+		fastws::TodoList<long> tdl(&data[0], n, .2);
+		inline_finds(tdl, "TodoList", keys);
+	}
+	{
+		fastws::PrefixTodoList<long> ptl(.2);
+		for (size_t i = 0; i < n; i++)
+			ptl.add(2*i);
+		inline_finds(ptl, "PrefixTodoList(inline)", keys);
+	}
+	{
+		fastws::PrefixTodoList<long, fastws::NoKeyPrefix<long> > ptl(.2);
+		for (size_t i = 0; i < n; i++)
+			ptl.add(2*i);
+		inline_finds(ptl, "PrefixTodoList(no-prefix)", keys);
+	}
+	vector<int> data(n);
+	for (size_t i = 0; i < n; i++)
+		data[i] = 2*i;
+	// WSSkiplist gets Zipf-distributed finds, as elsewhere, and fewer of
+	// them, since nearly every find ends in a rebuild(i) that costs more
+	// than the search
+	vector<int> ikeys(m / 1000);
+	for (size_t i = 0; i < ikeys.size(); i++)
+		ikeys[i] = 2*(zipf_data(i, n) % n) - (i % 2);
+	{
+		fastws::WSSkiplist<int> wsl(&data[0], n, compare_ints, .2);
+		inline_finds(wsl, "WSSkiplist", ikeys);
+	}
+	{
+		fastws::WSSkiplist<int, true> wsl(&data[0], n, compare_ints, .2);
+		inline_finds(wsl, "WSSkiplist(inline)", ikeys);
+	}
+}
+
+// Run r reader threads and one writer on d for secs seconds and report the
+// number of finds and updates per second
+template<class Dict>
+void concurrent_reads(Dict &d, const char *name, size_t n, int r,
+		double secs) {
+	atomic<bool> stop(false);
+	vector<size_t> counts(r);
+	vector<long> sums(r);
+	vector<thread> readers;
+	for (int j = 0; j < r; j++) {
+		readers.push_back(thread([&d, &stop, &counts, &sums, n, j]() {
+			typename Dict::Reader rd(d);
+			unsigned seed = j + 1;
+			size_t c = 0;
+			long sum = 0;
+			while (!stop.load(memory_order_relaxed)) {
+				sum += rd.find(rand_r(&seed) % (5*n));
+				c++;
+			}
+			counts[j] = c;
+			sums[j] = sum;
+		}));
+	}
+	unsigned seed = 0;
+	size_t writes = 0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (chrono::duration<double>(chrono::steady_clock::now() - start)
+			.count() < secs) {
+		int x = rand_r(&seed) % (5*n);
+		if (writes++ % 2)
+			d.remove(x);
+		else
+			d.add(x);
+	}
+	stop.store(true);
+	size_t reads = 0;
+	for (int j = 0; j < r; j++) {
+		readers[j].join();
+		reads += counts[j];
+		summer += sums[j]; // to make sure this isn't optimized away
+	}
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now()
+			- start).count();
+	cout << name << " READERS " << r << " " << reads / elapsed << " "
+			<< writes / elapsed << endl;
+}
+
+void concurrent_suite(size_t n, double secs) {
+	cout << "Structure Operation #readers finds/second updates/second"
+			<< endl;
+	for (int r = 1; r <= 8; r *= 2) {
+		LockedTodoList d;
+		srand(1);
+		for (size_t i = 0; i < n; i++)
+			d.add(rand_data(i, n));
+		concurrent_reads(d, "LockedTodoList", n, r, secs);
+	}
+	for (int r = 1; r <= 8; r *= 2) {
+		fastws::RcuTodoList<int> d;
+		srand(1);
+		for (size_t i = 0; i < n; i++)
+			d.add(rand_data(i, n));
+		concurrent_reads(d, "RcuTodoList", n, r, secs);
+	}
+}
+
+// Add n keys from gen_data in batches of b to a ShardedTodoList with 1, 2,
+// 4, ... threads (and as many shards), and to a plain TodoList
+void shard_suite(size_t n, size_t b, int (*gen_data)(size_t, size_t)) {
+	cout << "Structure Operation threads time adds/second shards steals"
+			<< endl;
+	vector<int> data(n);
+	srand(1);
+	for (size_t i = 0; i < n; i++)
+		data[i] = gen_data(i, n);
+	{
+		fastws::TodoList<int> tdl(NULL, 0, .2);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (size_t i = 0; i < n; i++)
+			tdl.add(data[i]);
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now()
+				- start).count();
+		cout << "TodoList ADD 1 " << elapsed << " " << n / elapsed
+				<< " 1 0" << endl;
+	}
+	for (int t = 1; t <= 32; t *= 2) {
+		fastws::ShardedTodoList<int> stl(t, t, .2);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (size_t i = 0; i < n; i += b)
+			stl.addBatch(&data[i], min(b, n - i));
+		double elapsed = chrono::duration<double>(chrono::steady_clock::now()
+				- start).count();
+		cout << "ShardedTodoList ADDBATCH " << t << " " << elapsed << " "
+				<< n / elapsed << " " << stl.numShards() << " "
+				<< stl.steals() << endl;
+	}
+}
 
 void test_suite(size_t n, int (*gen_data)(size_t, size_t),
 		int (*gen_search)(size_t, size_t)) {
@@ -151,6 +1075,24 @@ void test_suite(size_t n, int (*gen_data)(size_t, size_t),
 	{
 		fastws::TodoList<Integer> tdl(NULL, 0, .2);
 		build_and_search(tdl, "TodoList", n, gen_data, gen_search);
+		cout << "I: bytes per element = "
+				<< ((double)tdl.bytesUsed()) / tdl.size() << endl;
+		cout << "I: node allocations per add = "
+				<< ((double)tdl.nodeAllocations()) / n << endl;
+		cout << "I: system allocations per add = "
+				<< ((double)tdl.systemAllocations()) / n << endl;
+	}
+	{
+		fastws::CompactTodoList<Integer> ctl(NULL, 0, .2);
+		build_and_search(ctl, "CompactTodoList", n, gen_data, gen_search);
+		cout << "I: bytes per element = "
+				<< ((double)ctl.bytesUsed()) / ctl.size() << endl;
+	}
+	{
+		fastws::BTodoList<Integer> btl(NULL, 0, .2);
+		build_and_search(btl, "BTodoList", n, gen_data, gen_search);
+		cout << "I: bytes per element = "
+				<< ((double)btl.bytesUsed()) / btl.size() << endl;
 	}
 	{
 		ods::RedBlackTree1<Integer> rbt;
@@ -199,6 +1141,348 @@ void test_dicts(Dict1 &d1, Dict2 &d2, int n) {
 	}
 }
 
+// Same as test_dicts, but interleave removals with the additions
+template<class Dict1, class Dict2>
+void test_removes(Dict1 &d1, Dict2 &d2, int n) {
+	srand(1);
+	for (int i = 0; i < 2*n; i++) {
+		int x = rand() % (5*n);
+		if (rand() % 3 == 0)
+			assert(d1.remove(x) == d2.remove(x));
+		else
+			assert(d1.add(x) == d2.add(x));
+	}
+
+	for (int i = 0; i < 5*n; i++) {
+		int x = rand() % (5*(n+1))-2;
+		assert(d1.find(x) == d2.find(x));
+	}
+
+	for (int i = 0; i < 5*n; i++) {
+		int x = rand() % (5*n);
+		assert(d1.remove(x) == d2.remove(x));
+	}
+	assert((size_t)d1.size() == (size_t)d2.size());
+}
+
+// Check that d.findMany() agrees with d.find() for a few group sizes
+template<class Dict>
+void test_find_many(Dict &d, int n) {
+	srand(1);
+	vector<int> keys(n), out(n);
+	for (int i = 0; i < n; i++)
+		keys[i] = rand() % (5*(n+1))-2;
+	// check while d is still small, too
+	for (int i = 0, size = 0; size <= n; size = max(10*size, 1)) {
+		for (; i < size; i++)
+			d.add(rand() % (5*n));
+		for (int g = 1; g <= 32; g += 5) {
+			d.findMany(&keys[0], &out[0], n, g);
+			for (int j = 0; j < n; j++)
+				assert(out[j] == d.find(keys[j]));
+		}
+	}
+}
+
+
+// Do the same insertions, lookups and removals on a TodoMap and a std::map
+template<class K>
+void test_map(int n, K (*key)(int)) {
+	srand(7);
+	fastws::TodoMap<K, int> tm;
+	map<K, int> m;
+	for (int i = 0; i < 3*n; i++) {
+		K x = key(rand() % (2*n));
+		int op = rand() % 4;
+		if (op == 0) {
+			assert(tm.insertOrAssign(x, i) == (m.find(x) == m.end()));
+			m[x] = i;
+		} else if (op == 1) {
+			pair<int*,bool> r = tm.emplace(x, i);
+			pair<typename map<K,int>::iterator,bool> r2 = m.emplace(x, i);
+			assert(r.second == r2.second && *r.first == r2.first->second);
+		} else if (op == 2 && i % 3 == 0) {
+			assert(tm.remove(x) == (m.erase(x) == 1));
+		} else {
+			int *v = tm.get(x);
+			typename map<K,int>::iterator it = m.find(x);
+			assert(it == m.end() ? v == NULL : *v == it->second);
+			const K *y = NULL;
+			v = tm.find(x, &y);
+			it = m.lower_bound(x);
+			assert(it == m.end() ? v == NULL
+					: *y == it->first && *v == it->second);
+		}
+	}
+	assert(tm.size() == m.size());
+	typename map<K,int>::iterator it = m.begin();
+	for (typename fastws::TodoMap<K,int>::Iterator j = tm.begin();
+			j != tm.end(); ++j, ++it)
+		assert(j.key() == it->first && j.value() == it->second);
+	assert(it == m.end());
+}
+
+// Save a TodoList as a snapshot, in a file and in shared memory, and check
+// the snapshot against it, including from another process.  The list is
+// incremental, so it is usually saved in the middle of a job.
+void test_snapshot(size_t n) {
+	const char *paths[] = { "/tmp/fastws-sanity.snap", "/fastws-sanity" };
+	fastws::TodoList<int> tdl;
+	tdl.setIncremental(true);
+	srand(8);
+	for (size_t i = 0; i < n; i++)
+		tdl.add(rand() % (5*n));
+	for (int shm = 0; shm < 2; shm++) {
+		assert(fastws::TodoSnapshot<int>::save(tdl, paths[shm], shm));
+		pid_t pid = fork();
+		fastws::TodoSnapshot<int> snap(paths[shm], shm);
+		assert(snap.isOpen() && snap.size() == tdl.size());
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*(n+1)) - 2;
+			assert(snap.find(x) == tdl.find(x));
+		}
+		if (pid == 0)
+			_exit(0);
+		int status;
+		waitpid(pid, &status, 0);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		assert(!fastws::TodoSnapshot<long>(paths[shm], shm).isOpen());
+		assert(snap.add(-1) && snap.find(-2) == -1 && snap.remove(-1));
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*n);
+			assert(snap.add(x) == tdl.add(x));
+		}
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*(n+1)) - 2;
+			assert(snap.find(x) == tdl.find(x));
+		}
+		if (!shm) {
+			// a snapshot whose header doesn't fit the file isn't opened
+			int fd = open(paths[shm], O_WRONLY);
+			int32_t k = 1000;
+			uint64_t n0 = (uint64_t)1 << 62;
+			assert(pwrite(fd, &n0, sizeof(n0), 40) == sizeof(n0));
+			assert(!fastws::TodoSnapshot<int>(paths[shm]).isOpen());
+			assert(pwrite(fd, &k, sizeof(k), 16) == sizeof(k));
+			assert(!fastws::TodoSnapshot<int>(paths[shm]).isOpen());
+			close(fd);
+		}
+		fastws::TodoSnapshot<int>::unlink(paths[shm], shm);
+	}
+}
+
+// Check that stats() agrees with what was done to each structure
+template<class Dict>
+void check_stats(Dict &d, size_t adds, size_t finds) {
+	fastws::Stats s = d.stats();
+	assert(s.n == (size_t)d.size() && s.levels.size() == (size_t)s.k + 1);
+	assert(s.levels[s.k].size == s.n);
+	for (int i = 0; i < s.k; i++)
+		assert(s.levels[i].size <= s.levels[i+1].size);
+	assert(s.levels[s.k].rebuilds > 0 && s.bytesUsed > 0);
+	if (s.enabled) {
+		assert(s.adds == adds && s.finds == finds);
+		assert(s.comparisons >= s.finds && s.levels[s.k].touched > 0);
+	}
+	string json = statsJson(s);
+	assert(json[0] == '{' && json[json.size()-1] == '}');
+	assert(count(json.begin(), json.end(), '[')
+			== count(json.begin(), json.end(), ']'));
+}
+
+void test_stats(size_t n) {
+	srand(9);
+	{
+		fastws::TodoList<int> tdl;
+		fastws::TodoList2<int> tdl2(NULL, 0, .4, INT_MAX);
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*n);
+			tdl.add(x);
+			tdl2.add(x);
+		}
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*n);
+			assert(tdl.find(x) == tdl2.find(x));
+		}
+		check_stats(tdl, n, n);
+		check_stats(tdl2, n, n);
+	}
+	{
+		// most WSSkiplist finds rebuild a big list, so keep this one small
+		size_t m = n/100;
+		vector<int> data(m);
+		for (size_t i = 0; i < m; i++)
+			data[i] = 2*i;
+		fastws::WSSkiplist<int> wsl(&data[0], m, compare_ints, .2);
+		for (size_t i = 0; i < m; i++) {
+			int x = 2*(zipf_data(i, m) % m);
+			assert(wsl.find(x) == x);
+		}
+		check_stats(wsl, 0, m);
+		assert(!wsl.stats().enabled || wsl.stats().promotions > 0);
+	}
+}
+
+// An auto-tuned TodoList, whose eps changes as it goes, checked against a
+// RedBlackTree1 through a write-heavy and then a read-heavy phase
+void test_autotune(size_t n) {
+	fastws::TodoList<int> tdl(NULL, 0, .2);
+	ods::RedBlackTree1<int> rbt;
+	tdl.setAutoTune(true, .1, .6);
+	srand(12);
+	for (size_t i = 0; i < 8*n; i++) {
+		int x = rand() % (5*n);
+		int op = rand() % 10;
+		if (op < ((i < 4*n) ? 7 : 1)) {
+			assert(tdl.add(x) == rbt.add(x));
+		} else if (op < ((i < 4*n) ? 8 : 2)) {
+			assert(tdl.remove(x) == rbt.remove(x));
+		} else {
+			assert(tdl.find(x) == rbt.find(x));
+		}
+		assert(tdl.size() == (size_t)rbt.size());
+	}
+	double eps = tdl.stats().eps;
+	assert(eps >= .1 && eps <= .6);
+	test_dicts(tdl, rbt, n);
+}
+
+// Check a set with prefixes in its towers against std::set
+template<class Set, class K>
+void test_prefix(Set &d, size_t n, K (*key)(int)) {
+	set<K> s;
+	srand(14);
+	for (size_t i = 0; i < 4*n; i++) {
+		K x = key(rand() % (2*n));
+		int op = rand() % 4;
+		if (op < 2) {
+			assert(d.add(x) == s.insert(x).second);
+		} else if (op < 3) {
+			assert(d.remove(x) == (s.erase(x) > 0));
+		} else {
+			const K *y = d.find(x);
+			typename set<K>::iterator it = s.lower_bound(x);
+			assert((y == NULL) == (it == s.end()));
+			assert(y == NULL || *y == *it);
+		}
+		assert((size_t)d.size() == s.size());
+	}
+}
+
+// A string and its zero-padded extension have the same prefix
+template<class Set>
+void test_prefix_ties(Set &d) {
+	string z("key"), z0("key\0", 4);
+	assert(d.add(z0) && d.add(z) && !d.add(z0));
+	assert(*d.find(z) == z && *d.find(z0) == z0);
+	assert(d.remove(z) && *d.find(z) == z0 && d.remove(z0));
+}
+
+// Check that a WSSkiplist with keys in its towers finds what one without
+// them does, as both promote the same nodes
+void test_inline(size_t n) {
+	vector<int> data(n);
+	for (size_t i = 0; i < n; i++)
+		data[i] = 2*i;
+	fastws::WSSkiplist<int> wsl(&data[0], n, compare_ints, .2);
+	fastws::WSSkiplist<int, true> iwsl(&data[0], n, compare_ints, .2);
+	for (size_t i = 0; i < 4*n; i++) {
+		int x = 2*(zipf_data(i, n) % n) - (i % 2);
+		int y = wsl.find(x);
+		assert(y == x + (int)(i % 2) && iwsl.find(x) == y);
+	}
+	assert(wsl.size() == iwsl.size());
+}
+
+// Many small batches on a TaskPool, so that workers still leaving one batch
+// race with the next one, which has to finish with every task run once
+void test_taskpool(size_t batches) {
+	fastws::TaskPool pool(4);
+	atomic<size_t> done(0);
+	vector<function<void()> > tasks;
+	for (size_t i = 0; i < batches; i++) {
+		for (int j = 0; j < 2; j++)
+			tasks.push_back([&done]() { done++; });
+		pool.run(tasks);
+		assert(tasks.empty() && done.load() == 2*(i+1));
+	}
+}
+
+// An incremental TodoList, with finds and removes in the middle of the jobs
+// that add lists, and then switched back to normal
+void test_incremental(size_t n) {
+	fastws::TodoList<int> tdl;
+	ods::RedBlackTree1<int> rbt;
+	tdl.setIncremental(true);
+	srand(10);
+	for (size_t i = 0; i < n; i++) {
+		int x = (i % 2) ? 3*i : rand() % (3*n);
+		assert(tdl.add(x) == rbt.add(x));
+		int y = rand() % (3*(i+1));
+		assert(tdl.find(y) == rbt.find(y));
+		if (i % 5 == 0) {
+			y = rand() % (3*(i+1));
+			assert(tdl.remove(y) == rbt.remove(y));
+		}
+		assert((size_t)tdl.size() == (size_t)rbt.size());
+	}
+	test_removes(tdl, rbt, n);
+	tdl.setIncremental(false);
+	test_dicts(tdl, rbt, n);
+}
+
+// Readers look for elements that are always there while the writer adds and
+// removes others, enough of them to cause global rebuilds in both directions
+void test_rcu(size_t n) {
+	fastws::RcuTodoList<int> tdl;
+	for (size_t i = 0; i < n; i++)
+		tdl.add(10*i);
+	atomic<bool> stop(false);
+	vector<thread> readers;
+	for (int r = 0; r < 3; r++) {
+		readers.push_back(thread([&tdl, &stop, n, r]() {
+			fastws::RcuTodoList<int>::Reader rd(tdl);
+			unsigned seed = r;
+			while (!stop.load()) {
+				int x = 10*(rand_r(&seed) % (n-1));
+				assert(rd.find(x) == x);
+				int y = rd.find(x + 1);
+				assert(x < y && y <= x + 10);
+			}
+		}));
+	}
+	vector<int> others;
+	for (size_t i = 0; i < 9*n; i++)
+		others.push_back(10*(i/9) + 1 + i%9);
+	for (int rep = 0; rep < 2; rep++) {
+		random_shuffle(others.begin(), others.end());
+		for (size_t i = 0; i < others.size(); i++)
+			assert(tdl.add(others[i]));
+		random_shuffle(others.begin(), others.end());
+		for (size_t i = 0; i < others.size(); i++)
+			assert(tdl.remove(others[i]));
+	}
+	stop.store(true);
+	for (size_t r = 0; r < readers.size(); r++)
+		readers[r].join();
+	assert(tdl.size() == n);
+
+	// there are only so many reader slots, and they get reused
+	vector<fastws::RcuTodoList<int>::Reader*> rds;
+	bool full = false;
+	while (!full) {
+		try {
+			rds.push_back(new fastws::RcuTodoList<int>::Reader(tdl));
+		} catch (const length_error &) {
+			full = true;
+		}
+	}
+	assert(rds.size() > 3);
+	delete rds.back();
+	rds.back() = new fastws::RcuTodoList<int>::Reader(tdl);
+	for (size_t r = 0; r < rds.size(); r++)
+		delete rds[r];
+}
 
 void sanity_tests(size_t n) {
 	{
@@ -221,9 +1505,238 @@ void sanity_tests(size_t n) {
 		ods::RedBlackTree1<int> rbt;
 		test_dicts(tdl, rbt, n);
 	}
+	{
+		fastws::TodoList<int> tdl;
+		ods::Treap1<int> t;
+		test_removes(tdl, t, n);
+	}
+	{
+		vector<int> data(n);
+		for (size_t i = 0; i < n; i++)
+			data[i] = rand() % (5*n);
+		fastws::TodoList<int> tdl;
+		ods::RedBlackTree1<int> rbt;
+		tdl.bulkLoad(&data[0], n);
+		for (size_t i = 0; i < n; i++)
+			rbt.add(data[i]);
+		test_dicts(tdl, rbt, n);
+	}
+	{
+		fastws::TodoList<int> tdl;
+		ods::RedBlackTree1<int> rbt;
+		srand(2);
+		for (size_t i = 0; i < n; i += 1000) {
+			vector<int> batch(1000);
+			for (size_t j = 0; j < batch.size(); j++) {
+				batch[j] = rand() % (5*n);
+				rbt.add(batch[j]);
+			}
+			sort(batch.begin(), batch.end());
+			tdl.addBatch(batch.begin(), batch.end());
+		}
+		assert((size_t)tdl.size() == (size_t)rbt.size());
+		test_dicts(tdl, rbt, n);
+	}
+	{
+		// mostly increasing keys, with some jitter, so the finger gets used
+		fastws::TodoList<int> tdl;
+		ods::RedBlackTree1<int> rbt;
+		srand(6);
+		for (size_t i = 0; i < n; i++) {
+			int x = (i % 1000 < 900) ? 5*i + rand() % 20 : rand() % (5*n);
+			assert(tdl.add(x) == rbt.add(x));
+			int y = x + rand() % 10 - 3;
+			assert(tdl.findNear(y) == rbt.find(y));
+			y = x + rand() % 500;  // far enough to climb from the finger
+			assert(tdl.findNear(y) == rbt.find(y));
+		}
+		test_dicts(tdl, rbt, n);
+	}
+	{
+		// iterators and range queries against a sorted array
+		fastws::TodoList<int> tdl;
+		vector<int> v;
+		srand(4);
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*n);
+			tdl.add(x);
+			v.push_back(x);
+			if (rand() % 3 == 0)
+				tdl.remove(rand() % (5*n));
+		}
+		v.clear();
+		for (fastws::TodoList<int>::Iterator it = tdl.begin(); it != tdl.end();
+				++it)
+			v.push_back(*it);
+		assert(v.size() == tdl.size());
+		for (size_t i = 1; i < v.size(); i++)
+			assert(v[i-1] < v[i]);
+		for (size_t i = 0; i < n; i++) {
+			int x = rand() % (5*(n+1)) - 2;
+			vector<int>::iterator lb = lower_bound(v.begin(), v.end(), x);
+			vector<int>::iterator ub = upper_bound(v.begin(), v.end(), x);
+			fastws::TodoList<int>::Iterator it = tdl.lowerBound(x);
+			assert(lb == v.end() ? it == tdl.end() : *it == *lb);
+			it = tdl.upperBound(x);
+			assert(ub == v.end() ? it == tdl.end() : *it == *ub);
+			assert(tdl.predecessor(x) == (lb == v.begin() ? 0 : *(lb-1)));
+			int y = x + rand() % 100;
+			long sum = 0, count;
+			count = tdl.rangeScan(x, y, [&sum](int z) { sum += z; });
+			vector<int>::iterator hb = lower_bound(v.begin(), v.end(), y);
+			assert(count == hb - lb);
+			assert(sum == accumulate(lb, hb, 0L));
+		}
+	}
+	{
+		fastws::TodoList2<int> tdl(NULL, 0, .4, INT_MAX);
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(tdl, rbt, n);
+	}
+	{
+		fastws::TodoList<int> tdl;
+		srand(3);
+		vector<int> keys(n), out(n);
+		for (size_t size = 0; size <= n; size = max(10*size, (size_t)1)) {
+			while ((size_t)tdl.size() < size)
+				tdl.add(rand() % (5*n));
+			for (size_t i = 0; i < n; i++)
+				keys[i] = rand() % (5*(size+1)) - 2;
+			sort(keys.begin(), keys.end());
+			tdl.findSorted(&keys[0], &out[0], n);
+			for (size_t i = 0; i < n; i++)
+				assert(out[i] == tdl.find(keys[i]));
+		}
+	}
+	{
+		fastws::TodoList<int> tdl;
+		test_find_many(tdl, n);
+		fastws::TodoList2<int> tdl2(NULL, 0, .4, INT_MAX);
+		test_find_many(tdl2, n);
+		ods::SkiplistSSet<int> sl;
+		test_find_many(sl, n);
+	}
+	{
+		fastws::BTodoList<int> btl;
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(btl, rbt, n);
+	}
+	{
+		fastws::BgTodoList<int> tdl;
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(tdl, rbt, n);
+	}
+	test_taskpool(10*n);
+	{
+		fastws::ShardedTodoList<int> stl(4, 3);
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(stl, rbt, n);
+	}
+	{
+		fastws::ShardedTodoList<int> stl(4, 3);
+		ods::RedBlackTree1<int> rbt;
+		srand(5);
+		vector<int> batch(1000);
+		for (size_t i = 0; i < n; i += batch.size()) {
+			size_t added = 0;
+			for (size_t j = 0; j < batch.size(); j++) {
+				batch[j] = (i % 3 == 0) ? zipf_data(j, n) : rand() % (5*n);
+				added += rbt.add(batch[j]);
+			}
+			assert(stl.addBatch(&batch[0], batch.size()) == added);
+		}
+		assert(stl.size() == (size_t)rbt.size() && stl.numShards() > 1);
+		vector<int> keys(n), out(n);
+		for (size_t i = 0; i < n; i++)
+			keys[i] = rand() % (5*(n+1)) - 2;
+		stl.findBatch(&keys[0], &out[0], n);
+		for (size_t i = 0; i < n; i++)
+			assert(out[i] == rbt.find(keys[i]));
+	}
+	{
+		fastws::RcuTodoList<int> tdl;
+		ods::Treap1<int> t;
+		test_removes(tdl, t, n);
+		test_rcu(n/10);
+	}
+	{
+		fastws::TodoList3<int> tdl;
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(tdl, rbt, n);
+	}
+	{
+		fastws::TodoList3<int, 20> tdl;
+		ods::Treap1<int> t;
+		test_removes(tdl, t, n);
+	}
+	{
+		// with room for only four lists, the add that needs a fifth throws
+		fastws::TodoList3<int, 40, 3> tdl;
+		size_t m = 0;
+		try {
+			for (int x = 0; ; x += 2, m++)
+				tdl.add(x);
+		} catch (const length_error &) {
+		}
+		assert(m > 0 && tdl.size() == m);
+		for (int x = -1; x < 2*(int)m; x++)
+			assert(tdl.find(x) == ((x < 2*(int)m - 1) ? x + (x & 1) : 0));
+	}
+	{
+		fastws::CompactTodoList<int> ctl;
+		ods::RedBlackTree1<int> rbt;
+		test_dicts(ctl, rbt, n);
+	}
+	{
+		fastws::CompactTodoList<int> ctl(NULL, 0, .2);
+		ods::Treap1<int> t;
+		test_removes(ctl, t, n);
+	}
+	test_incremental(n);
+	test_autotune(n);
+	{
+		fastws::PrefixTodoList<string> d(.2);
+		test_prefix(d, n/10, word_key);
+		test_prefix_ties(d);
+	}
+	{
+		fastws::PrefixTodoList<string> d;
+		test_prefix(d, n/10, string_key);
+		test_prefix_ties(d);
+	}
+	{
+		ods::PrefixSkiplistSSet<string> d;
+		test_prefix(d, n/10, string_key);
+		test_prefix_ties(d);
+	}
+	{
+		ods::PrefixSkiplistSSet<string, fastws::NoKeyPrefix<string> > d;
+		test_prefix(d, n/10, url_key);
+	}
+	{
+		fastws::PrefixTodoList<long> d;
+		test_prefix(d, n, signed_key);
+	}
+	test_inline(n/100);
+	test_snapshot(n);
+	test_stats(n);
+	test_map(n, int_key);
+	test_map(n/10, string_key);
 }
 
 int main(int argc, char **argv) {
+	// -b <n> runs only the large-n benchmark, with n elements
+	size_t big = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		if (opt == 'b')
+			big = atof(optarg);
+	}
+	if (big > 0) {
+		large_test(big);
+		return 0;
+	}
+
 	// start with some sanity tests
 	cout << "I: Doing sanity tests...";
 	cout.flush();
@@ -245,6 +1758,54 @@ int main(int argc, char **argv) {
 		cout << endl << "Shuffled additions" << endl;
 		test_suite(n, shuffle_data, rand_search);
 		cout << endl;
+		cout << endl << "Batched additions" << endl;
+		batch_suite(n, 1000);
+		cout << endl;
+		cout << endl << "Sorted finds (sequential data)" << endl;
+		find_sorted_suite(n, n/100, sequential_data);
+		cout << endl;
+		cout << endl << "Sorted finds (shuffled data)" << endl;
+		find_sorted_suite(n, n/100, shuffle_data);
+		cout << endl;
+		cout << endl << "Range scans" << endl;
+		range_suite(n, n/10, 100);
+		cout << endl;
+		cout << endl << "Batched finds" << endl;
+		find_many_suite(n, 5*n);
+		cout << endl;
+		cout << endl << "Sharded additions (random)" << endl;
+		shard_suite(4*n, 10000, rand_data);
+		cout << endl;
+		cout << endl << "Sharded additions (Zipf)" << endl;
+		shard_suite(4*n, 10000, zipf_data);
+		cout << endl;
+		cout << endl << "Map lookups" << endl;
+		map_suite(n, 5*n);
+		cout << endl;
+		cout << endl << "Unrolled finds" << endl;
+		unrolled_suite(5*n);
+		cout << endl;
+		cout << endl << "Snapshots" << endl;
+		snapshot_suite(4*n, 5*n);
+		cout << endl;
+		cout << endl << "Statistics" << endl;
+		stats_suite(n, 5*n);
+		cout << endl;
+		cout << endl << "Concurrent finds" << endl;
+		concurrent_suite(n, 1);
+		cout << endl;
+		cout << endl << "Key-inlined towers" << endl;
+		inline_suite(4*n, 5*n);
+		cout << endl;
+		cout << endl << "String keys" << endl;
+		prefix_suite(n, 5*n);
+		cout << endl;
+		cout << endl << "Auto-tuned eps" << endl;
+		tune_suite(n);
+		cout << endl;
+		cout << endl << "Add latencies" << endl;
+		latency_suite(4*n, rand_data);
+		cout << endl;
 	}
 }
 
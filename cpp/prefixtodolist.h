@@ -0,0 +1,393 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * prefixtodolist.h : A top-down skiplist that keeps key prefixes in its
+ *                    towers
+ *
+ * This is TodoList for keys that are expensive to compare, like strings.
+ * In TodoList, each step of a search does u->next[i]->x < x, which loads
+ * the next node and then the key it points to, and runs the full
+ * comparison.  Here each entry of a tower holds the pointer and
+ * P::of() of the key it points at (see keyprefix.h), so the step is
+ * decided by an integer comparison with the prefix of x, and the key is
+ * only looked at when the two prefixes are equal.  ties() counts those
+ * times.  With integer keys the prefix is the key (P::exact), so the
+ * tower entry holds a copy of the key and a search step reads nothing but
+ * the entry.
+ *
+ * Keys are constructed and destroyed in place, so T can be any type that
+ * P knows about.  find(x) returns a pointer to the key it finds, so nothing
+ * gets copied on the lookup path.  A global rebuild moves the keys to new
+ * nodes, so these pointers are good until the next add(x) or remove(x).
+ *
+ * - add(x) and remove(x) run in O(log n) amortized time.
+ * - find(x) runs in O(log n) worst-case time and performs
+ *   ceiling((1+epsilon)log n) prefix comparisons.
+ */
+#ifndef FASTWS_PREFIXTODOLIST_H_
+#define FASTWS_PREFIXTODOLIST_H_
+
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+#include <iostream>
+#include <algorithm>
+#include <new>
+#include <utility>
+using namespace std;
+
+#include "arena.h"
+#include "keyprefix.h"
+#include "stats.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+template<class T, class P = KeyPrefix<T> >
+class PrefixTodoList {
+protected:
+	struct Node;
+
+	struct Link {
+		uint64_t pre;  // P::of(node->x), if node isn't NULL
+		Node *node;
+	};
+
+	struct Node {
+		uint64_t pre;  // P::of(x)
+		T x;           // data
+		Link next[];   // a stack of next pointers
+	};
+
+	int k;    // there are k+1 lists numbered 0,...,k
+	int kmax; // k never gets bigger than this
+	size_t *n;   // n[i] is the size of the i'th list
+	Node *sentinel; // sentinel-next[i] is the first element of list i
+	Arena *arena;   // where all the nodes come from
+
+	// parameters used to determine lists sizes
+	double eps;
+	size_t n0max;
+	size_t *a;
+
+	// scratch space for recording search paths
+	Node **path;
+
+	// the number of full comparisons, which happen when prefixes tie
+	size_t nties;
+	StatCounters counters;
+
+	// does the node l points at come before x, whose prefix is px?
+	bool precedes(const Link &l, uint64_t px, const T &x) {
+		counters.touch(&l);
+		counters.touch((const char *)(&l + 1) - 1);
+		if (l.node == NULL)
+			return false;
+		counters.compare();
+		if (l.pre != px)
+			return l.pre < px;
+		if (P::exact)
+			return false;  // l.node holds x
+		nties++;
+		counters.touch(&l.node->x);
+		return l.node->x < x;
+	}
+	// is w, which is known not to be less than x, holding x?
+	bool holds(Node *w, uint64_t px, const T &x) {
+		if (w == NULL || w->pre != px)
+			return false;
+		if (P::exact)
+			return true;
+		nties++;
+		return !(x < w->x);
+	}
+	static void link(Node *u, int i, Node *v) {
+		u->next[i].node = v;
+		u->next[i].pre = (v == NULL) ? 0 : v->pre;
+	}
+
+	void init(size_t n0);
+	void rebuild();
+	void rebuild(int i);
+
+	Node *newNode();
+	void deleteNode(Node *u);
+	Node *search(const T &x, uint64_t px);
+
+public:
+	PrefixTodoList(double eps0 = .4);
+	virtual ~PrefixTodoList();
+	const T* find(const T &x);
+	bool add(const T &x);
+	bool remove(const T &x);
+	size_t size() {
+		return n[k];
+	}
+	size_t ties() {
+		return nties;
+	}
+	size_t bytesUsed() {
+		return arena->bytesReserved() + sizeof(*this)
+				+ (kmax+1)*(2*sizeof(size_t) + sizeof(Node*));
+	}
+	Stats stats();
+	void resetStats() {
+		counters.reset();
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class T, class P>
+PrefixTodoList<T,P>::PrefixTodoList(double eps0) {
+	eps = eps0;
+
+	kmax = maxLevel(eps);
+	path = new Node*[kmax+1];
+	n = new size_t[kmax+1]();
+	a = new size_t[kmax+1];
+	setThresholds(a, kmax, eps);
+	nties = 0;
+	arena = NULL;
+	init(0);
+}
+
+/**
+ * Start over with room for n0 elements: a new arena, an empty sentinel and
+ * the sizes of the lists set for n0 elements that haven't been linked yet
+ */
+template<class T, class P>
+void PrefixTodoList<T,P>::init(size_t n0) {
+	n0max = 1;
+	k = max(0.0, ceil(log(n0) / log(2-eps)));
+	assert(k <= kmax);
+	fill(n, n + kmax + 1, 0);
+	n[k] = n0;
+	arena = new Arena(sizeof(Node) + (k + 1) * sizeof(Link));
+	sentinel = newNode();
+}
+
+template<class T, class P>
+typename PrefixTodoList<T,P>::Node* PrefixTodoList<T,P>::newNode() {
+	Node *u = (Node *) arena->alloc();
+	for (int i = 0; i <= k; i++)
+		link(u, i, NULL);
+	return u;
+}
+
+template<class T, class P>
+void PrefixTodoList<T,P>::deleteNode(Node *u) {
+	u->x.~T();
+	arena->free(u);
+}
+
+/**
+ * Move everything into nodes with room for the new number of lists
+ */
+template<class T, class P>
+void PrefixTodoList<T,P>::rebuild() {
+	Node *u = sentinel->next[k].node;
+	int k0 = k;
+	Arena *old = arena;
+	init(n[k]);
+	Node *prev = sentinel;
+	while (u != NULL) {
+		Node *v = newNode();
+		new (&v->x) T(std::move(u->x));
+		v->pre = u->pre;
+		link(prev, k, v);
+		prev = v;
+		Node *next = u->next[k0].node;
+		u->x.~T();
+		u = next;
+	}
+	delete old;
+	rebuild(k);
+}
+
+/**
+ * Rebuild L_0,...,L_{i-1} from L_i with one walk along L_i, as in
+ * TodoList::rebuild(i)
+ */
+template<class T, class P>
+void PrefixTodoList<T,P>::rebuild(int i) {
+	for (int j = 0; j < i; j++)
+		path[j] = sentinel;  // the last node of L_j so far
+	size_t t = 0;
+	for (Node *u = sentinel->next[i].node; u != NULL; u = u->next[i].node) {
+		int d = min(i, __builtin_ctzll(++t));
+		for (int j = i - d; j < i; j++) {
+			link(path[j], j, u);
+			path[j] = u;
+		}
+	}
+	for (int j = 0; j < i; j++) {
+		link(path[j], j, NULL);
+		n[j] = (i - j < 64) ? n[i] >> (i - j) : 0;
+	}
+}
+
+/**
+ * Record the search path for x in path[] and return the node that holds x,
+ * or NULL if x isn't here
+ */
+template<class T, class P>
+typename PrefixTodoList<T,P>::Node* PrefixTodoList<T,P>::search(const T &x,
+		uint64_t px) {
+	Node *u = sentinel;
+	for (int i = 0; i <= k; i++) {
+		if (precedes(u->next[i], px, x))
+			u = u->next[i].node;
+		path[i] = u;
+	}
+	Node *w = u->next[k].node;
+	return holds(w, px, x) ? w : NULL;
+}
+
+/**
+ * Return a pointer to the smallest key >= x, or NULL if there isn't one
+ */
+template<class T, class P>
+const T* PrefixTodoList<T,P>::find(const T &x) {
+	counters.find();
+	uint64_t px = P::of(x);
+	Node *u = sentinel;
+	for (int i = 0; i <= k; i++) {
+		if (precedes(u->next[i], px, x))
+			u = u->next[i].node;
+	}
+	Node *w = u->next[k].node;
+	return (w == NULL) ? NULL : &w->x;
+}
+
+template<class T, class P>
+bool PrefixTodoList<T,P>::add(const T &x) {
+	counters.add();
+	uint64_t px = P::of(x);
+	if (search(x, px) != NULL)
+		return false;
+
+	// insert x everywhere along the search path
+	Node *w = newNode();
+	new (&w->x) T(x);
+	w->pre = px;
+	int i;
+	for (i = k; i >= 0; i--) {
+		w->next[i] = path[i]->next[i];
+		link(path[i], i, w);
+		n[i]++;
+	}
+
+	// check if we need to add another level on the bottom
+	if (n[k] > a[k])
+		rebuild();
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T, class P>
+bool PrefixTodoList<T,P>::remove(const T &x) {
+	counters.remove();
+	Node *w = search(x, P::of(x));
+	if (w == NULL)
+		return false;
+
+	// unlink w from every list it appears in
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (path[i]->next[i].node == w) {
+			path[i]->next[i] = w->next[i];
+			n[i]--;
+		}
+	}
+	deleteNode(w);
+
+	// promote the second element of any L_i gap that got too big, as in
+	// TodoList::remove()
+	for (i = k - 1; i >= 0; i--) {
+		Node *end = path[i]->next[i].node;
+		Node *v = path[i]->next[i+1].node;
+		if (v == end || v->next[i+1].node == end)
+			continue;
+		v = v->next[i+1].node;
+		v->next[i] = path[i]->next[i];
+		link(path[i], i, v);
+		n[i]++;
+	}
+
+	// check if we need to remove a level from the bottom
+	if (k > 1 && n[k] < a[k-2]) {
+		rebuild();
+		return true;
+	}
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T, class P>
+PrefixTodoList<T,P>::~PrefixTodoList() {
+	for (Node *u = sentinel->next[k].node; u != NULL;) {
+		Node *next = u->next[k].node;
+		u->x.~T();
+		u = next;
+	}
+	delete arena;
+	delete[] n;
+	delete[] a;
+	delete[] path;
+}
+
+template<class T, class P>
+Stats PrefixTodoList<T,P>::stats() {
+	Stats s;
+	s.structure = "PrefixTodoList";
+	s.n = n[k];
+	s.k = k;
+	s.eps = eps;
+	s.bytesUsed = bytesUsed();
+	s.levels.resize(k + 1);
+	for (int i = 0; i <= k; i++) {
+		LevelStats &l = s.levels[i];
+		l.size = n[i];
+		l.maxSize = a[i];
+		l.bound = (i == 0) ? n0max : a[i];
+		l.rebuilds = 0;
+		l.touched = 0;
+		l.seconds = 0;
+	}
+	counters.fill(s);
+	return s;
+}
+
+template<class T, class P>
+void PrefixTodoList<T,P>::printOn(std::ostream &out) {
+	out << "PrefixTodoList: n = " << n[k] << ", k = " << k << endl;
+	for (int i = 0; i <= k; i++)
+		out << " n(" << i << ") = " << n[i] << endl;
+}
+
+template<class T, class P>
+ostream& operator<<(ostream &out, PrefixTodoList<T,P> &l) {
+	l.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_PREFIXTODOLIST_H_
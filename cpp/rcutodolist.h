@@ -0,0 +1,280 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * rcutodolist.h : A top-down skiplist with one writer and lock-free readers
+ *
+ * Any number of threads can search an RcuTodoList while one thread (the
+ * writer) adds and removes elements.  Readers never lock or write to
+ * anything shared except for their own slot in a table of epochs.
+ *
+ * - The writer publishes every link with a release store, and a node's
+ *   pointers are always set before the node can be reached, so a reader
+ *   only ever sees NULL or a node that was in the list when it looked.
+ * - A partial rebuild, rebuild(i), relinks L_0,...,L_{i-1} in place.  This
+ *   is safe because L_k is never touched, so a reader that gets a stale
+ *   view of the upper lists still ends up in the right place in L_k.
+ *   Readers search each list with a while loop instead of the usual single
+ *   comparison, since they may see a list while it is half rebuilt.
+ * - A global rebuild builds a whole new TodoList off to the side and then
+ *   publishes it with one pointer store.
+ * - Removed nodes and replaced TodoLists are retired and only freed after
+ *   every reader that was active when they were retired has finished.  This
+ *   is the usual epoch scheme: a reader copies the global epoch into its
+ *   slot while it searches, and the writer frees something retired in epoch
+ *   e once no slot holds an epoch <= e.
+ *
+ * Reader threads search through a Reader object, which holds their slot.
+ * There are maxReaders (128) slots, and making a Reader while they are all
+ * taken throws std::length_error.
+ */
+#ifndef FASTWS_RCUTODOLIST_H_
+#define FASTWS_RCUTODOLIST_H_
+
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <stdexcept>
+
+#include "todolist.h"
+
+namespace fastws {
+
+template<class T>
+class RcuTodoList {
+protected:
+	typedef typename TodoList<T>::Node Node;
+
+	// the epoch of each active reader, or 0 if it isn't searching
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> epoch;
+		std::atomic<bool> taken;
+	};
+	static const int maxReaders = 128;
+
+	// something the writer is done with, but readers may not be
+	struct Retired {
+		uint64_t epoch;      // the epoch it was retired in
+		TodoList<T> *owner;  // the TodoList it belongs to
+		Node *u;             // the node, or NULL to retire all of owner
+	};
+
+	// how many retired nodes to collect before trying to free them
+	static const size_t batch = 64;
+
+	double eps;
+	std::atomic<TodoList<T>*> cur;
+	std::atomic<uint64_t> epoch;
+	Slot slots[maxReaders];
+	std::deque<Retired> retired;
+
+	// the number of global rebuilds so far, for printOn()
+	int rebuilds;
+
+	static Node* load(Node **p) {
+		return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+	}
+	void replace(TodoList<T> *l, T x, bool adding);
+	void retire(TodoList<T> *owner, Node *u);
+	void reclaim();
+
+public:
+	/**
+	 * A reader's handle on an RcuTodoList.  Each reader thread should make
+	 * its own, and none of them may outlive the RcuTodoList.  At most
+	 * maxReaders of them can exist at once.
+	 */
+	class Reader {
+	protected:
+		RcuTodoList<T> *t;
+		Slot *s;
+	public:
+		Reader(RcuTodoList<T> &t0);
+		~Reader();
+		T find(T x);
+	};
+
+	RcuTodoList(double eps0 = .4);
+	virtual ~RcuTodoList();
+
+	// these may only be called by the writer
+	T find(T x) {
+		return cur.load(std::memory_order_relaxed)->find(x);
+	}
+	bool add(T x);
+	bool remove(T x);
+	size_t size() {
+		return cur.load(std::memory_order_relaxed)->size();
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class T>
+RcuTodoList<T>::RcuTodoList(double eps0) : epoch(1) {
+	eps = eps0;
+	rebuilds = 0;
+	for (int i = 0; i < maxReaders; i++) {
+		slots[i].epoch.store(0, std::memory_order_relaxed);
+		slots[i].taken.store(false, std::memory_order_relaxed);
+	}
+	TodoList<T> *l = new TodoList<T>(NULL, 0, eps);
+	l->keepDeleted = true;
+	cur.store(l, std::memory_order_release);
+}
+
+template<class T>
+RcuTodoList<T>::~RcuTodoList() {
+	// there are no readers left, so everything can go
+	for (size_t j = 0; j < retired.size(); j++)
+		if (retired[j].u == NULL)
+			delete retired[j].owner;
+	delete cur.load(std::memory_order_relaxed);
+}
+
+template<class T>
+RcuTodoList<T>::Reader::Reader(RcuTodoList<T> &t0) {
+	t = &t0;
+	for (int i = 0; i < maxReaders; i++) {
+		bool free = false;
+		if (t->slots[i].taken.compare_exchange_strong(free, true)) {
+			s = &t->slots[i];
+			return;
+		}
+	}
+	throw std::length_error("RcuTodoList: more than maxReaders readers");
+}
+
+template<class T>
+RcuTodoList<T>::Reader::~Reader() {
+	s->taken.store(false, std::memory_order_release);
+}
+
+template<class T>
+T RcuTodoList<T>::Reader::find(T x) {
+	// announce our epoch before looking at anything
+	s->epoch.store(t->epoch.load(std::memory_order_acquire),
+			std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	TodoList<T> *l = t->cur.load(std::memory_order_acquire);
+	Node *u = l->sentinel, *w = NULL;
+	for (int i = 0; i <= l->k; i++) {
+		while ((w = load(&u->next[i])) != NULL && w->x < x)
+			u = w;
+	}
+	// w is the successor of u that we checked, so don't load it again
+	T y = (w == NULL) ? (T)NULL : w->x;
+
+	s->epoch.store(0, std::memory_order_release);
+	return y;
+}
+
+template<class T>
+bool RcuTodoList<T>::add(T x) {
+	TodoList<T> *l = cur.load(std::memory_order_relaxed);
+	if (!l->full())
+		return l->add(x);  // this won't do a global rebuild
+	Node *w = l->findNode(x);
+	if (w != NULL && w->x == x)
+		return false;
+	replace(l, x, true);
+	return true;
+}
+
+template<class T>
+bool RcuTodoList<T>::remove(T x) {
+	TodoList<T> *l = cur.load(std::memory_order_relaxed);
+	Node *w = l->findNode(x);
+	if (w == NULL || !(w->x == x))
+		return false;
+	int k = l->k;
+	if (k > 1 && l->n[k] - 1 < l->a[k-2]) {
+		// l->remove(x) would do a global rebuild
+		replace(l, x, false);
+		return true;
+	}
+	l->remove(x);
+	retire(l, w);
+	return true;
+}
+
+/**
+ * Do a global rebuild of l, with x added (or removed), into a new TodoList
+ * and publish it
+ */
+template<class T>
+void RcuTodoList<T>::replace(TodoList<T> *l, T x, bool adding) {
+	size_t enn = l->size();
+	T *data = new T[enn + 1];
+	size_t j = 0;
+	bool done = !adding;
+	for (Node *u = l->sentinel->next[l->k]; u != NULL; u = u->next[l->k]) {
+		if (!done && x < u->x) {
+			data[j++] = x;
+			done = true;
+		}
+		if (adding || !(u->x == x))
+			data[j++] = u->x;
+	}
+	if (!done)
+		data[j++] = x;
+	TodoList<T> *l2 = new TodoList<T>(data, j, eps);
+	delete[] data;
+	l2->keepDeleted = true;
+	cur.store(l2, std::memory_order_release);
+	rebuilds++;
+	retire(l, NULL);
+	reclaim();
+}
+
+template<class T>
+void RcuTodoList<T>::retire(TodoList<T> *owner, Node *u) {
+	Retired r;
+	r.epoch = epoch.load(std::memory_order_relaxed);
+	r.owner = owner;
+	r.u = u;
+	retired.push_back(r);
+	if (retired.size() >= batch)
+		reclaim();
+}
+
+/**
+ * Start a new epoch and free everything that no reader can still see
+ */
+template<class T>
+void RcuTodoList<T>::reclaim() {
+	uint64_t e = epoch.fetch_add(1) + 1;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint64_t oldest = e;
+	for (int i = 0; i < maxReaders; i++) {
+		uint64_t ei = slots[i].epoch.load(std::memory_order_acquire);
+		if (ei != 0 && ei < oldest)
+			oldest = ei;
+	}
+	while (!retired.empty() && retired.front().epoch < oldest) {
+		Retired &r = retired.front();
+		if (r.u == NULL)
+			delete r.owner;
+		else
+			r.owner->arena.free(r.u);
+		retired.pop_front();
+	}
+}
+
+template<class T>
+void RcuTodoList<T>::printOn(std::ostream &out) {
+	out << "RcuTodoList: n = " << size() << " (rebuilt " << rebuilds
+		<< " times, " << retired.size() << " retired)" << endl;
+	cur.load(std::memory_order_relaxed)->printOn(out);
+}
+
+template<class T>
+ostream& operator<<(ostream &out, RcuTodoList<T> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_RCUTODOLIST_H_
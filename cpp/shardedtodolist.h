@@ -0,0 +1,275 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * shardedtodolist.h : A TodoList split into key ranges that are updated in
+ *                     parallel
+ *
+ * The key space is cut into shards by a sorted array of splitter keys, and
+ * shard s is a TodoList holding the elements in [splitter[s-1], splitter[s]).
+ * addBatch() and findBatch() sort a batch of requests by shard and then run
+ * one task per shard on a work-stealing TaskPool.  Every shard has its own
+ * arena, so the threads don't share anything while they work.
+ *
+ * After each batch, any shard that has grown to more than twice its share
+ * (size()/P) is split in half and any two neighbours that together hold less
+ * than one share are merged, so skewed (e.g., Zipf-distributed) keys still
+ * end up spread over about P shards of about the same size.
+ *
+ * - addBatch(xs, m) takes O((m/P + P) log n) time with P threads.
+ * - find(x) and add(x) are the usual TodoList operations after an
+ *   O(log P) time search of the splitters.
+ */
+#ifndef FASTWS_SHARDEDTODOLIST_H_
+#define FASTWS_SHARDEDTODOLIST_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "todolist.h"
+#include "taskpool.h"
+
+namespace fastws {
+
+template<class T>
+class ShardedTodoList {
+protected:
+	// shards smaller than this are never split
+	static constexpr size_t minShard = 1024;
+
+	int P;     // the number of shards we aim for
+	double eps;
+	std::vector<T> splitters;  // splitters[s] is the smallest key in shard s+1
+	std::vector<TodoList<T>*> shards;
+	TaskPool pool;
+
+	// the number of elements in all the shards, which split() and merge()
+	// only move around
+	size_t enn;
+
+	// the number of splits and merges so far, for printOn()
+	int splits, merges;
+
+	size_t shardOf(T x) {
+		return upper_bound(splitters.begin(), splitters.end(), x)
+				- splitters.begin();
+	}
+	std::vector<std::vector<size_t> > route(const T *xs, size_t m);
+	size_t target();
+	void split(size_t s);
+	void merge(size_t s);
+	void rebalance();
+
+public:
+	ShardedTodoList(int P0 = 0, int nthreads = 0, double eps0 = .4);
+	virtual ~ShardedTodoList();
+	T find(T x);
+	bool add(T x);
+	size_t addBatch(const T *xs, size_t m);
+	void findBatch(const T *keys, T *out, size_t m);
+	size_t size() {
+		return enn;
+	}
+	int numShards() {
+		return shards.size();
+	}
+	size_t steals() {
+		return pool.steals();
+	}
+
+	void printOn(std::ostream &out);
+};
+
+/**
+ * Aim for P0 shards, worked on by nthreads threads.  Either one defaults to
+ * the number of cores.
+ */
+template<class T>
+ShardedTodoList<T>::ShardedTodoList(int P0, int nthreads, double eps0)
+		: pool(nthreads) {
+	P = (P0 > 0) ? P0 : pool.threads();
+	eps = eps0;
+	splits = merges = 0;
+	enn = 0;
+	shards.push_back(new TodoList<T>(NULL, 0, eps));
+}
+
+template<class T>
+ShardedTodoList<T>::~ShardedTodoList() {
+	for (size_t s = 0; s < shards.size(); s++)
+		delete shards[s];
+}
+
+template<class T>
+T ShardedTodoList<T>::find(T x) {
+	// the answer is in x's shard or is the first element of a later one
+	for (size_t s = shardOf(x); s < shards.size(); s++) {
+		typename TodoList<T>::Iterator it = shards[s]->lowerBound(x);
+		if (it != shards[s]->end())
+			return *it;
+	}
+	return (T)NULL;
+}
+
+template<class T>
+bool ShardedTodoList<T>::add(T x) {
+	size_t s = shardOf(x);
+	if (!shards[s]->add(x))
+		return false;
+	enn++;
+	if (shards[s]->size() > 2*target())
+		rebalance();
+	return true;
+}
+
+/**
+ * Return, for each shard, the indices of the elements of xs that go there
+ */
+template<class T>
+std::vector<std::vector<size_t> > ShardedTodoList<T>::route(const T *xs,
+		size_t m) {
+	std::vector<std::vector<size_t> > idx(shards.size());
+	for (size_t j = 0; j < m; j++)
+		idx[shardOf(xs[j])].push_back(j);
+	return idx;
+}
+
+/**
+ * Add xs[0],...,xs[m-1] (in any order) and return the number of them that
+ * were new
+ */
+template<class T>
+size_t ShardedTodoList<T>::addBatch(const T *xs, size_t m) {
+	std::vector<std::vector<size_t> > idx = route(xs, m);
+	std::vector<size_t> added(shards.size());
+	std::vector<std::function<void()> > tasks;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (idx[s].empty())
+			continue;
+		tasks.push_back([this, s, xs, &idx, &added]() {
+			std::vector<T> batch(idx[s].size());
+			for (size_t j = 0; j < batch.size(); j++)
+				batch[j] = xs[idx[s][j]];
+			sort(batch.begin(), batch.end());
+			added[s] = shards[s]->addBatch(batch.begin(), batch.end());
+		});
+	}
+	pool.run(tasks);
+	size_t total = 0;
+	for (size_t s = 0; s < added.size(); s++)
+		total += added[s];
+	enn += total;
+	rebalance();
+	return total;
+}
+
+/**
+ * Set out[j] = find(keys[j]) for j = 0,...,m-1
+ */
+template<class T>
+void ShardedTodoList<T>::findBatch(const T *keys, T *out, size_t m) {
+	// first[s] is the answer for keys bigger than everything in shard s
+	std::vector<T> first(shards.size());
+	T next = (T)NULL;
+	for (size_t s = shards.size(); s-- > 0;) {
+		first[s] = next;
+		if (shards[s]->size() > 0)
+			next = *shards[s]->begin();
+	}
+	std::vector<std::vector<size_t> > idx = route(keys, m);
+	std::vector<std::function<void()> > tasks;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (idx[s].empty())
+			continue;
+		tasks.push_back([this, s, keys, out, &idx, &first]() {
+			TodoList<T> *l = shards[s];
+			for (size_t j = 0; j < idx[s].size(); j++) {
+				size_t i = idx[s][j];
+				typename TodoList<T>::Iterator it = l->lowerBound(keys[i]);
+				out[i] = (it != l->end()) ? *it : first[s];
+			}
+		});
+	}
+	pool.run(tasks);
+}
+
+/**
+ * The size a shard should have
+ */
+template<class T>
+size_t ShardedTodoList<T>::target() {
+	return std::max(size() / P, minShard);
+}
+
+/**
+ * Split shard s into two shards of the same size
+ */
+template<class T>
+void ShardedTodoList<T>::split(size_t s) {
+	std::vector<T> data(shards[s]->begin(), shards[s]->end());
+	size_t h = data.size() / 2;
+	TodoList<T> *l1 = new TodoList<T>(&data[0], h, eps);
+	TodoList<T> *l2 = new TodoList<T>(&data[h], data.size() - h, eps);
+	delete shards[s];
+	shards[s] = l1;
+	shards.insert(shards.begin() + s + 1, l2);
+	splitters.insert(splitters.begin() + s, data[h]);
+	splits++;
+}
+
+/**
+ * Merge shards s and s+1
+ */
+template<class T>
+void ShardedTodoList<T>::merge(size_t s) {
+	std::vector<T> data(shards[s]->begin(), shards[s]->end());
+	data.insert(data.end(), shards[s+1]->begin(), shards[s+1]->end());
+	TodoList<T> *l = new TodoList<T>(data.empty() ? NULL : &data[0],
+			data.size(), eps);
+	delete shards[s];
+	delete shards[s+1];
+	shards[s] = l;
+	shards.erase(shards.begin() + s + 1);
+	splitters.erase(splitters.begin() + s);
+	merges++;
+}
+
+template<class T>
+void ShardedTodoList<T>::rebalance() {
+	size_t t = target();
+	for (size_t s = 0; s < shards.size(); s++) {
+		while (shards[s]->size() > 2*t)
+			split(s);
+	}
+	for (size_t s = 0; s + 1 < shards.size();) {
+		if (shards[s]->size() + shards[s+1]->size() < t)
+			merge(s);
+		else
+			s++;
+	}
+}
+
+template<class T>
+void ShardedTodoList<T>::printOn(std::ostream &out) {
+	out << "ShardedTodoList: n = " << size() << ", " << shards.size()
+		<< " shards (" << splits << " splits, " << merges << " merges, "
+		<< pool.steals() << " steals)" << endl;
+	for (size_t s = 0; s < shards.size(); s++) {
+		out << "shard " << s;
+		if (s > 0)
+			out << " [" << splitters[s-1];
+		else
+			out << " (-inf";
+		out << ",...): n = " << shards[s]->size() << endl;
+	}
+}
+
+template<class T>
+ostream& operator<<(ostream &out, ShardedTodoList<T> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_SHARDEDTODOLIST_H_
@@ -0,0 +1,176 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * simd.h : Searching small sorted arrays of keys with SIMD instructions
+ *
+ * packedRank(keys, m, x) returns the number of keys in keys[0..m-1] that
+ * are less than x.  For int, 64-bit integer and double keys this uses
+ * AVX2 (or SSE) compares, whose all-ones lanes are subtracted from a vector
+ * of counts that is summed across at the end, so m must be a multiple of 8
+ * and unused slots should be padded with a value that isn't less than
+ * anything.
+ * Other arithmetic types fall back to a branch-free scalar loop.
+ *
+ * packable<T>::value says whether keys of type T are cheap enough to compare
+ * that it's worth keeping a packed copy of them around.
+ */
+#ifndef FASTWS_SIMD_H_
+#define FASTWS_SIMD_H_
+
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace fastws {
+
+template<class T>
+struct packable {
+	static const bool value = std::is_arithmetic<T>::value;
+};
+
+template<class T>
+inline int packedRank(const T *keys, int m, T x) {
+	int r = 0;
+	for (int i = 0; i < m; i++)
+		r += keys[i] < x;
+	return r;
+}
+
+#if defined(__AVX2__)
+
+// The sum of the 32-bit (or 64-bit) lanes of v
+inline int hsum32(__m256i v) {
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+			_mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+inline int hsum64(__m256i v) {
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(v),
+			_mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	return (int)_mm_cvtsi128_si64(s);
+}
+
+// Each compare gives -1 in the lanes where a key is less than x, so
+// subtracting the results counts them without any popcounts
+inline int packedRank32(const int32_t *keys, int m, int32_t x) {
+	__m256i vx = _mm256_set1_epi32(x);
+	__m256i r = _mm256_setzero_si256();
+	for (int i = 0; i < m; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+		r = _mm256_sub_epi32(r, _mm256_cmpgt_epi32(vx, v));
+	}
+	return hsum32(r);
+}
+
+inline int packedRank64(const int64_t *keys, int m, int64_t x) {
+	__m256i vx = _mm256_set1_epi64x(x);
+	__m256i r = _mm256_setzero_si256();
+	for (int i = 0; i < m; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+		r = _mm256_sub_epi64(r, _mm256_cmpgt_epi64(vx, v));
+	}
+	return hsum64(r);
+}
+
+template<>
+inline int packedRank<double>(const double *keys, int m, double x) {
+	__m256d vx = _mm256_set1_pd(x);
+	__m256i r = _mm256_setzero_si256();
+	for (int i = 0; i < m; i += 4) {
+		__m256d lt = _mm256_cmp_pd(_mm256_loadu_pd(keys + i), vx, _CMP_LT_OQ);
+		r = _mm256_sub_epi64(r, _mm256_castpd_si256(lt));
+	}
+	return hsum64(r);
+}
+
+#elif defined(__SSE2__)
+
+// The sum of the 32-bit (or 64-bit) lanes of v
+inline int hsum32(__m128i s) {
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1,0,3,2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+inline int hsum64(__m128i s) {
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	return (int)_mm_cvtsi128_si64(s);
+}
+
+// Each compare gives -1 in the lanes where a key is less than x, so
+// subtracting the results counts them.  (__builtin_popcount would be a
+// library call unless we are compiled with -mpopcnt.)
+inline int packedRank32(const int32_t *keys, int m, int32_t x) {
+	__m128i vx = _mm_set1_epi32(x);
+	__m128i r = _mm_setzero_si128();
+	for (int i = 0; i < m; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+		r = _mm_sub_epi32(r, _mm_cmpgt_epi32(vx, v));
+	}
+	return hsum32(r);
+}
+
+#ifdef __SSE4_2__
+inline int packedRank64(const int64_t *keys, int m, int64_t x) {
+	__m128i vx = _mm_set1_epi64x(x);
+	__m128i r = _mm_setzero_si128();
+	for (int i = 0; i < m; i += 2) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+		r = _mm_sub_epi64(r, _mm_cmpgt_epi64(vx, v));
+	}
+	return hsum64(r);
+}
+#else
+inline int packedRank64(const int64_t *keys, int m, int64_t x) {
+	int r = 0;
+	for (int i = 0; i < m; i++)
+		r += keys[i] < x;
+	return r;
+}
+#endif
+
+template<>
+inline int packedRank<double>(const double *keys, int m, double x) {
+	__m128d vx = _mm_set1_pd(x);
+	__m128i r = _mm_setzero_si128();
+	for (int i = 0; i < m; i += 2) {
+		__m128d lt = _mm_cmplt_pd(_mm_loadu_pd(keys + i), vx);
+		r = _mm_sub_epi64(r, _mm_castpd_si128(lt));
+	}
+	return hsum64(r);
+}
+
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+template<>
+inline int packedRank<int>(const int *keys, int m, int x) {
+	return packedRank32((const int32_t*)keys, m, x);
+}
+
+template<>
+inline int packedRank<long>(const long *keys, int m, long x) {
+	if (sizeof(long) == sizeof(int64_t))
+		return packedRank64((const int64_t*)keys, m, x);
+	return packedRank32((const int32_t*)keys, m, x);
+}
+
+template<>
+inline int packedRank<long long>(const long long *keys, int m, long long x) {
+	return packedRank64((const int64_t*)keys, m, x);
+}
+
+#endif
+
+} // fastws namespace
+
+#endif // FASTWS_SIMD_H_
@@ -0,0 +1,205 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * stats.h : Run-time statistics for the skiplists
+ *
+ * stats() on a TodoList, TodoList2 or WSSkiplist returns a Stats, which is
+ * a plain struct that can also print itself as JSON.  The list sizes, their
+ * thresholds, the number of times each rebuild(i) ran and the memory in use
+ * are always there, since the structures keep them anyway.
+ *
+ * Everything else (comparisons, promotions, the cache lines finds read, the
+ * nodes touched and time spent by rebuilds) comes from a StatCounters
+ * member that only counts when the code is compiled with -DFASTWS_STATS.
+ * Otherwise all of its methods are empty and inline, so they cost nothing,
+ * and Stats::enabled is false.
+ */
+#ifndef FASTWS_STATS_H_
+#define FASTWS_STATS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fastws {
+
+struct LevelStats {
+	size_t size;       // n[i]
+	size_t maxSize;    // a[i], the size rebuilds aim to keep n[i] under
+	size_t bound;      // n[i] > bound triggers a rebuild (b[i] in WSSkiplist)
+	size_t rebuilds;   // calls to rebuild(i), which rebuilds L_0,...,L_{i-1}
+	size_t touched;    // nodes visited by those calls
+	double seconds;    // time spent in them
+};
+
+struct Stats {
+	std::string structure;
+	bool enabled;      // were the counters compiled in?
+	size_t n;
+	int k;
+	double eps;
+	size_t bytesUsed;
+	std::vector<LevelStats> levels;
+
+	// these are 0 unless enabled
+	size_t finds, adds, removes;
+	size_t comparisons;  // key comparisons done by finds, adds and removes
+	size_t promotions;   // times find(x) added a node to a list (WSSkiplist)
+	size_t lines;        // cache lines read by the searches in finds
+	size_t globalRebuilds;
+	double globalSeconds;
+
+	double comparisonsPerOp() const {
+		size_t ops = finds + adds + removes;
+		return ops ? (double)comparisons / ops : 0;
+	}
+	double promotionsPerFind() const {
+		return finds ? (double)promotions / finds : 0;
+	}
+	double linesPerFind() const {
+		return finds ? (double)lines / finds : 0;
+	}
+
+	void printJson(std::ostream &out) const;
+};
+
+inline void Stats::printJson(std::ostream &out) const {
+	out << "{\"structure\": \"" << structure << "\""
+		<< ", \"enabled\": " << (enabled ? "true" : "false")
+		<< ", \"n\": " << n << ", \"k\": " << k << ", \"eps\": " << eps
+		<< ", \"bytes_used\": " << bytesUsed
+		<< ", \"finds\": " << finds << ", \"adds\": " << adds
+		<< ", \"removes\": " << removes
+		<< ", \"comparisons\": " << comparisons
+		<< ", \"comparisons_per_op\": " << comparisonsPerOp()
+		<< ", \"promotions\": " << promotions
+		<< ", \"promotions_per_find\": " << promotionsPerFind()
+		<< ", \"lines_per_find\": " << linesPerFind()
+		<< ", \"global_rebuilds\": " << globalRebuilds
+		<< ", \"global_rebuild_seconds\": " << globalSeconds
+		<< ", \"levels\": [";
+	for (size_t i = 0; i < levels.size(); i++) {
+		const LevelStats &l = levels[i];
+		out << (i ? ", " : "") << "{\"level\": " << i
+			<< ", \"size\": " << l.size << ", \"a\": " << l.maxSize
+			<< ", \"b\": " << l.bound << ", \"rebuilds\": " << l.rebuilds
+			<< ", \"touched\": " << l.touched
+			<< ", \"seconds\": " << l.seconds << "}";
+	}
+	out << "]}";
+}
+
+/**
+ * The counters behind a Stats.  A structure calls these as things happen
+ * and copies them into a Stats with fill().
+ *
+ * A find calls touch(p) for every address its search reads, and a line
+ * counts if it isn't one of the last few the search read.  On a list too
+ * big for the cache, that is about the number of cache misses per find.
+ */
+class StatCounters {
+#ifdef FASTWS_STATS
+protected:
+	size_t finds, adds, removes, comparisons, promotions, globalRebuilds;
+	size_t lines;
+	uintptr_t recent[4];  // the last lines touch() saw
+	double globalSeconds;
+	std::vector<size_t> touched;
+	std::vector<double> seconds;
+
+public:
+	static const bool enabled = true;
+
+	StatCounters() {
+		reset();
+	}
+	void reset() {
+		finds = adds = removes = comparisons = promotions = 0;
+		globalRebuilds = 0;
+		lines = 0;
+		std::fill(recent, recent + 4, (uintptr_t)0);
+		globalSeconds = 0;
+		touched.clear();
+		seconds.clear();
+	}
+	void find() { finds++; }
+	void add() { adds++; }
+	void remove() { removes++; }
+	void compare() { comparisons++; }
+	void promote() { promotions++; }
+	void touch(const void *p) {
+		uintptr_t l = (uintptr_t)p >> 6;
+		if (l == recent[0] || l == recent[1] || l == recent[2]
+				|| l == recent[3])
+			return;
+		std::copy_backward(recent, recent + 3, recent + 4);
+		recent[0] = l;
+		lines++;
+	}
+
+	// a time to pass to rebuilt() or rebuiltAll() afterwards
+	double now() {
+		return std::chrono::duration<double>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	void rebuilt(int i, size_t nodes, double start) {
+		if (touched.size() <= (size_t)i) {
+			touched.resize(i+1);
+			seconds.resize(i+1);
+		}
+		touched[i] += nodes;
+		seconds[i] += now() - start;
+	}
+	void rebuiltAll(double start) {
+		globalRebuilds++;
+		globalSeconds += now() - start;
+	}
+
+	void fill(Stats &s) {
+		s.enabled = true;
+		s.finds = finds;
+		s.adds = adds;
+		s.removes = removes;
+		s.comparisons = comparisons;
+		s.promotions = promotions;
+		s.lines = lines;
+		s.globalRebuilds = globalRebuilds;
+		s.globalSeconds = globalSeconds;
+		for (size_t i = 0; i < s.levels.size() && i < touched.size(); i++) {
+			s.levels[i].touched = touched[i];
+			s.levels[i].seconds = seconds[i];
+		}
+	}
+#else
+public:
+	static const bool enabled = false;
+
+	void reset() { }
+	void find() { }
+	void add() { }
+	void remove() { }
+	void compare() { }
+	void promote() { }
+	void touch(const void *) { }
+	double now() { return 0; }
+	void rebuilt(int, size_t, double) { }
+	void rebuiltAll(double) { }
+
+	void fill(Stats &s) {
+		s.enabled = false;
+		s.finds = s.adds = s.removes = s.comparisons = s.promotions = 0;
+		s.lines = 0;
+		s.globalRebuilds = 0;
+		s.globalSeconds = 0;
+	}
+#endif
+};
+
+} // fastws namespace
+
+#endif // FASTWS_STATS_H_
@@ -0,0 +1,169 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * taskpool.h : A small work-stealing thread pool
+ *
+ * run(tasks) hands out a batch of tasks round-robin to one deque per thread
+ * (the calling thread gets one too, and works) and returns once they have
+ * all finished.  Each thread takes tasks from the front of its own deque
+ * and, when that is empty, steals from the back of somebody else's, so one
+ * slow task doesn't leave the other threads idle behind it.
+ *
+ * The deques are short and each one has its own lock, which is plenty for
+ * the coarse tasks (one per shard) that ShardedTodoList makes.
+ */
+#ifndef FASTWS_TASKPOOL_H_
+#define FASTWS_TASKPOOL_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fastws {
+
+class TaskPool {
+protected:
+	typedef std::function<void()> Task;
+
+	struct alignas(64) Queue {
+		std::mutex m;
+		std::deque<Task> q;
+	};
+
+	int nthreads;  // worker threads, not counting the caller
+	std::vector<std::thread> workers;
+	Queue *queues;  // queues[nthreads] belongs to the caller of run()
+
+	std::mutex m;
+	std::condition_variable wake;
+	uint64_t generation;  // incremented by every call to run()
+	bool quit;
+	std::atomic<size_t> pending;  // tasks in the current batch not yet done
+
+	// statistics
+	std::atomic<size_t> stolen;
+
+	bool pop(int me, Task &f);
+	void drain(int me);
+	void work(int me);
+
+public:
+	TaskPool(int nthreads0 = 0);
+	virtual ~TaskPool();
+	void run(std::vector<Task> &tasks);
+	int threads() { return nthreads + 1; }
+	size_t steals() { return stolen.load(); }
+};
+
+/**
+ * Make a pool with nthreads0 threads in total (counting the one that calls
+ * run()), or one per core if nthreads0 is 0
+ */
+inline TaskPool::TaskPool(int nthreads0) : pending(0), stolen(0) {
+	if (nthreads0 <= 0)
+		nthreads0 = std::max(1u, std::thread::hardware_concurrency());
+	nthreads = nthreads0 - 1;
+	queues = new Queue[nthreads + 1];
+	generation = 0;
+	quit = false;
+	for (int i = 0; i < nthreads; i++)
+		workers.push_back(std::thread(&TaskPool::work, this, i));
+}
+
+inline TaskPool::~TaskPool() {
+	{
+		std::lock_guard<std::mutex> g(m);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	delete[] queues;
+}
+
+/**
+ * Take a task from the front of our own deque or, failing that, the back
+ * of someone else's
+ */
+inline bool TaskPool::pop(int me, Task &f) {
+	int nq = nthreads + 1;
+	for (int j = 0; j < nq; j++) {
+		Queue &q = queues[(me + j) % nq];
+		std::lock_guard<std::mutex> g(q.m);
+		if (q.q.empty())
+			continue;
+		if (j == 0) {
+			f = std::move(q.q.front());
+			q.q.pop_front();
+		} else {
+			f = std::move(q.q.back());
+			q.q.pop_back();
+			stolen++;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Run tasks until the current batch is finished
+ */
+inline void TaskPool::drain(int me) {
+	Task f;
+	while (pending.load(std::memory_order_acquire) > 0) {
+		if (pop(me, f)) {
+			f();
+			pending.fetch_sub(1, std::memory_order_acq_rel);
+		} else {
+			std::this_thread::yield();  // the last tasks are still running
+		}
+	}
+}
+
+inline void TaskPool::work(int me) {
+	uint64_t seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> g(m);
+			wake.wait(g, [&]() { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+		}
+		drain(me);
+	}
+}
+
+inline void TaskPool::run(std::vector<Task> &tasks) {
+	if (tasks.empty())
+		return;
+	// a worker still in drain() from the last batch may take one of these
+	// tasks as soon as it is pushed, so pending has to count it already
+	pending.store(tasks.size(), std::memory_order_release);
+	int nq = nthreads + 1;
+	for (size_t i = 0; i < tasks.size(); i++) {
+		Queue &q = queues[i % nq];
+		std::lock_guard<std::mutex> g(q.m);
+		q.q.push_back(std::move(tasks[i]));
+	}
+	if (nthreads > 0) {
+		{
+			std::lock_guard<std::mutex> g(m);
+			generation++;
+		}
+		wake.notify_all();
+	}
+	drain(nthreads);
+	tasks.clear();
+}
+
+} // fastws namespace
+
+#endif // FASTWS_TASKPOOL_H_
@@ -0,0 +1,42 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * thresholds.h : The list size thresholds shared by the top-down skiplists
+ *
+ * In a TodoList with parameter eps, L_i may hold at most a[i] = (2-eps)^i
+ * elements before it has to be rebuilt, and a new list is added at the
+ * bottom when L_k gets bigger than a[k].  Every variant uses the same
+ * thresholds, so they are set up here.
+ */
+#ifndef FASTWS_THRESHOLDS_H_
+#define FASTWS_THRESHOLDS_H_
+
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <cstddef>
+
+namespace fastws {
+
+/**
+ * The largest k that a list with parameter eps can ever need, which is the
+ * first i for which a[i] is more than any size_t
+ */
+inline int maxLevel(double eps) {
+	return ceil(log(2.0) * CHAR_BIT * sizeof(size_t) / log(2.0-eps)) + 1;
+}
+
+/**
+ * Set a[i] = (2-eps)^i, or SIZE_MAX if that is too big, for i = 0,...,kmax
+ */
+inline void setThresholds(size_t *a, int kmax, double eps) {
+	for (int i = 0; i <= kmax; i++) {
+		double ai = pow(2.0-eps, i);
+		a[i] = (ai >= (double)SIZE_MAX) ? SIZE_MAX : (size_t)ai;
+	}
+}
+
+} // fastws namespace
+
+#endif // FASTWS_THRESHOLDS_H_
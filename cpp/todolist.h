@@ -12,6 +12,12 @@
  * - add(x) and remove(x) run in O(log n) amortized time.
  * - find(x) runs in O(log n) worst-case time and performs
  *   ceiling((1+epsilon)log n) comparisons.
+ * - With setIncremental(true), add(x) and find(x) look at O(log n) nodes in
+ *   the worst case, and find(x) does up to gapMax comparisons per level.
+ *   So does remove(x), unless it takes the list down to fewer levels.
+ * - With setAutoTune(true), eps is chosen again at each global rebuild to
+ *   suit the measured cost of comparisons and rebuilds and the mix of
+ *   finds and updates.
  *
  * This particular implementation is a space hog.  Every element in the
  * structure has its own array of length k=Theta(log n)$.  This avoids the
@@ -24,19 +30,38 @@
 #include <cstring>
 #include <cstdlib>
 #include <climits>
+#include <cstdint>
 #include <cassert>
 
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <limits>
+#include <thread>
+#include <vector>
 using namespace std;
 
+#include "arena.h"
+#include "simd.h"
+#include "stats.h"
+#include "thresholds.h"
+
 namespace fastws {
 
+template<class T> class BgTodoList;
+template<class T> class RcuTodoList;
+template<class T> class TodoSnapshot;
+
 /**
  * A dictionary with the working-set property.
  */
 template<class T>
 class TodoList {
 protected:
+	friend class BgTodoList<T>;
+	friend class RcuTodoList<T>;
+	friend class TodoSnapshot<T>;
 	struct NP;
 
 	struct Node {
@@ -45,173 +70,1160 @@ protected:
 	};
 
 	int k;    // there are k+1 lists numbered 0,...,k
-	int *n;   // n[i] is the size of the i'th list
+	int kmax; // k never gets bigger than this
+	int kcap; // every node has room for next[0],...,next[kcap]
+	size_t *n;   // n[i] is the size of the i'th list, for i <= kmax
 	Node *sentinel; // sentinel-next[i] is the first element of list i
+	Arena arena;    // where all the nodes come from
 
 	// parameters used to determine lists sizes
 	double eps;
-	int n0max;
-	int *a;
+	size_t n0max;
+	size_t *a;
+
+	// scratch space for recording search paths
+	Node **path;
+
+	// path[] doubles as a finger.  After add(x) (or findNear(x)), path[i] is
+	// the last node of L_i that is <= x (or < x), but only path[f],...,path[k]
+	// are still good, where f = fingerLevel (k+1 means none of it is).  When
+	// the finger stops paying off it is only tried on every 16th search.
+	int fingerLevel;
+	bool fingerOn;
+	unsigned fingerTries;
+
+	// For arithmetic keys, we keep a packed copy of L_p, the largest list
+	// with at most pmax elements.  find(x) gets to the last node of L_p that
+	// is less than x with one SIMD search instead of p+1 pointer hops.
+	static const int pmax = 32;
+	int p;          // the packed list, or -1 if we aren't packing
+	size_t pn;      // the number of keys in pkeys
+	T *pkeys;       // the keys of L_p, padded with the largest T
+	Node **pnodes;  // pnodes[j] is the node containing pkeys[j]
+
+	// findMany(keys, out, m, g) interleaves at most gmax searches
+	static constexpr int gmax = 32;
+
+	// if set, remove(x) leaves the node for an RcuTodoList to free later
+	bool keepDeleted;
 
-	// FIXME: for profiling information
+	// rebuild_freqs[i] is the number of calls to rebuild(i), for stats()
 	int *rebuild_freqs;
+	StatCounters counters;
 
-	void init(T *data, int n);
+	// build() leaves room in each node for this many more lists, so the next
+	// few global rebuilds can relink the nodes we have
+	static const int headroom = 4;
+
+	// rebuild(i) splits L_i among threads once it has parMin nodes
+	static const size_t parMin = 1 << 16;
+	int nthreads;  // how many threads to use, or 0 for one per core
+
+	// In incremental mode add(x) never rebuilds anything on the spot.  x
+	// goes into L_k and is carried up into L_i only when its gap in L_i
+	// would hold gapMax nodes of L_{i+1}, and searches walk along each list.
+	// Everything else is a job that moves from left to right, jobStep nodes
+	// per add(x), remove(x) or find(x), and only one job runs at a time.
+	// - Going to k+1 lists splits L_k into a thinner L_k and a new L_{k+1}.
+	//   cursor is the first node of L_k the job hasn't reached (NULL when
+	//   there is no such job) and behind[i] is the last node of L_i it has
+	//   passed.  If the nodes have no room for L_{k+1}, the job is moving:
+	//   it copies each node it passes into a bigger one from spare, which
+	//   becomes the arena when the job is done.  The old arena is then
+	//   given back a chunk per operation.
+	// - When L_0 gets too big, L_0,...,L_{ri-1} are rebuilt from L_ri as in
+	//   rebuild(ri).  rcursor is the first node of L_ri the job hasn't
+	//   reached, and rrank counts the ones it has.  L_j is new up to
+	//   behind[j], which links to front[j], the first node of the old L_j
+	//   that the job hasn't passed.
+	static const int gapMax = 3;
+	static const int jobStep = 8;
+	bool incremental;
+	Node *cursor;
+	bool moving;
+	Arena spare;
+	Node *rcursor;
+	int ri;
+	size_t rrank;
+	Node **behind;
+	Node **front;
+
+	// With autoTune set, eps is chosen again at every global rebuild (and
+	// after tunePeriod*size() operations without one) to minimize the time
+	// per operation predicted from what was measured since the last time.
+	// A search takes about the same time on each of its log(n)/log(2-eps)
+	// lists, which is timed on every 256th find(x).  An update pays for the
+	// search and for the nodes that rebuild(i) touches, which are counted,
+	// and go down roughly as 1/eps, and every 64th rebuild(i) is timed.
+	static const int tunePeriod = 4;
+	static const size_t tuneMinOps = 4096;
+	bool autoTune;
+	double epsMin, epsMax;
+	size_t tuneReads, tuneWrites, tuneTouched;
+	size_t tuneFinds, tuneRebuilds, tuneSampled;
+	double tuneFindTime, tuneRebuildTime;
+
+	void init(T *data, size_t n);
+	void setEps(double e);
+	int levels(size_t m) {
+		return max(0.0, ceil(log(m) / log(2-eps)));
+	}
+	void build(const T *sorted, size_t m, int threads);
 	void rebuild();
 	void rebuild(int i);
+	void relink(int i, Node *u, size_t r, size_t m, Node **first,
+			Node **last);
+	int threadsFor(size_t m) {
+		if (m < parMin)
+			return 1;
+		int t = (nthreads > 0) ? nthreads : thread::hardware_concurrency();
+		return max(1, min(t, (int)(m / parMin)));
+	}
+	size_t sortUnique(const T *data, size_t n0, T *buf, int nthreads);
+	void pack();
+	Node *packedPred(T x);
 
 	void sanity();
 
-	Node *newNode();
+	Node *newNode(bool spared = false);
 	void deleteNode(Node *u);
+	Node *findPredNode(T x);
+	// For the wrappers that look at nodes themselves: the node with the
+	// smallest key >= x, and the elements in order, all without finishing
+	// (or advancing) a job, so the nodes stay put until the next update
+	Node *walkNode(T x) {
+		int b = walk(x, true);
+		return path[b]->next[b];
+	}
+	Node *first() {
+		return sentinel->next[(cursor != NULL) ? k + 1 : k];
+	}
+	Node *after(Node *u) {
+		return u->next[(cursor != NULL && u->x < cursor->x) ? k + 1 : k];
+	}
+	// is w a node with a key less than x? (this is what stats() counts)
+	bool precedes(Node *w, T x) {
+		if (w == NULL)
+			return false;
+		counters.compare();
+		return w->x < x;
+	}
+	bool fingerAgrees(int i, T x);
+	int fingerStart(T x);
+	Node *fingerSearch(T x);
+
+	int walk(T x, bool packed);
+	int gap(int i, Node **mid);
+	void promote(int i, Node *v);
+	void linked(int i, Node *v);
+	void unlinked(int i, Node *w);
+	bool addIncremental(T x);
+	bool removeIncremental(T x);
+	void startJob();
+	void step();
+	Node *move(Node *v);
+	void startRebuild(int i);
+	void rebuildStep();
+	void schedule();
+	void advance() {
+		for (int s = 0; s < jobStep; s++) {
+			if (cursor != NULL)
+				step();
+			else if (rcursor != NULL)
+				rebuildStep();
+			else
+				break;
+		}
+		if (!moving)
+			spare.shrink();  // the old nodes from the last move, if any
+	}
+	void finishJob() {
+		while (cursor != NULL)
+			step();
+		while (rcursor != NULL)
+			rebuildStep();
+	}
+	void tighten();
+
+	static double tuneClock() {
+		return chrono::duration<double>(
+				chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	void resetTuning() {
+		tuneReads = tuneWrites = tuneTouched = 0;
+		tuneFinds = tuneRebuilds = tuneSampled = 0;
+		tuneFindTime = tuneRebuildTime = 0;
+	}
+	bool retune();
+	// retune now if there hasn't been a global rebuild for a while
+	void tuneIfDue() {
+		if (tuneReads + tuneWrites > tunePeriod * size() + tuneMinOps
+				&& retune())
+			rebuild();
+	}
+	Node *tunedFind(T x);
+
+	// Links that readers may be following (in an RcuTodoList) are changed
+	// with release stores, so a reader that sees a node sees its contents
+	static void setNext(Node *u, int i, Node *v) {
+		__atomic_store_n(&u->next[i], v, __ATOMIC_RELEASE);
+	}
+	Node *findNode(T x);
 
 public:
-	TodoList(T *data = NULL, int n0 = 0, double eps0 = .4);
+	/**
+	 * A forward iterator over the elements in sorted order (that is, along
+	 * L_k).  Any add(x) or remove(x) invalidates it.  The keys are read-only,
+	 * since changing one in place could break the order of the lists.
+	 */
+	class Iterator {
+	protected:
+		friend class TodoList<T>;
+		Node *u;
+		int k;
+		Iterator(Node *u0, int k0) : u(u0), k(k0) { }
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const T* pointer;
+		typedef const T& reference;
+
+		Iterator() : u(NULL), k(0) { }
+		const T& operator*() const { return u->x; }
+		const T* operator->() const { return &u->x; }
+		Iterator& operator++() {
+			u = u->next[k];
+			if (u != NULL)
+				__builtin_prefetch(u->next[k]);
+			return *this;
+		}
+		Iterator operator++(int) {
+			Iterator it = *this;
+			++(*this);
+			return it;
+		}
+		bool operator==(const Iterator &it) const { return u == it.u; }
+		bool operator!=(const Iterator &it) const { return u != it.u; }
+	};
+
+	TodoList(T *data = NULL, size_t n0 = 0, double eps0 = .4,
+			bool hugepages = false);
 	virtual ~TodoList();
 	T find(T x);
+	T findNear(T x);
+	void findMany(const T *keys, T *out, size_t m, int g = 8);
+	void findSorted(const T *keys, T *out, size_t m);
+	T predecessor(T x);
+	Iterator begin() {
+		finishJob();
+		return Iterator(sentinel->next[k], k);
+	}
+	Iterator end() {
+		return Iterator(NULL, k);
+	}
+	Iterator lowerBound(T x);
+	Iterator upperBound(T x);
+	template<class F> size_t rangeScan(T lo, T hi, F f);
 	bool add(T x);
-	int size() {
-		return n[k];
+	bool remove(T x);
+	void bulkLoad(const T *data, size_t n0, int nthreads = 0);
+	template<class Iter> size_t addBatch(Iter first, Iter last);
+	size_t size() {
+		return (cursor != NULL) ? n[k+1] : n[k];
+	}
+	// true if adding one more element will trigger a global rebuild
+	bool full() {
+		return n[k] >= a[k];
+	}
+	size_t bytesUsed() {
+		return arena.bytesReserved() + spare.bytesReserved() + sizeof(*this)
+				+ (kmax+1)*(2*sizeof(size_t) + 3*sizeof(Node*) + sizeof(int));
+	}
+	size_t nodeAllocations() {
+		return arena.blockAllocations() + spare.blockAllocations();
+	}
+	size_t systemAllocations() {
+		return arena.systemAllocations() + spare.systemAllocations();
+	}
+	Stats stats();
+	void resetStats() {
+		counters.reset();
+	}
+	// use t threads for big rebuilds (0 means one per core)
+	void setThreads(int t) {
+		nthreads = t;
+	}
+	// bound the work of every add(x) and find(x), see incremental above.
+	// Turning this off rebuilds L_0,...,L_{k-1}.
+	void setIncremental(bool on) {
+		if (!on)
+			tighten();
+		incremental = on;
+		fingerLevel = k + 1;
+	}
+	// choose eps from [lo,hi] as we go, see autoTune above.  This is only
+	// done outside of incremental mode.
+	void setAutoTune(bool on, double lo = .05, double hi = .9) {
+		autoTune = on;
+		epsMin = lo;
+		epsMax = hi;
+		resetTuning();
 	}
 
 	void printOn(std::ostream &out);
 };
 
 template<class T>
-TodoList<T>::TodoList(T *data, int n0, double eps0) {
-	eps = eps0;
+TodoList<T>::TodoList(T *data, size_t n0, double eps0, bool hugepages)
+		: arena(sizeof(Node), hugepages), spare(sizeof(Node), hugepages) {
+	kmax = -1;
+	rebuild_freqs = NULL;
+	path = NULL;
+	behind = front = NULL;
+	n = NULL;
+	a = NULL;
+	setEps(eps0);
+	nthreads = 0;
+	incremental = false;
+	cursor = rcursor = NULL;
+	moving = false;
+	autoTune = false;
+	keepDeleted = false;
+	fingerLevel = kmax + 1;
+	fingerOn = false;
+	fingerTries = 0;
 
-	int kmax = 100; // FIXME: potential limitation here
-	rebuild_freqs = new int[kmax+1]();
-	double base_a = 2.0-eps;
-	a = new int[kmax+1];
-	for (int i = 0; i <= kmax; i++) {
-		a[i] = pow(base_a, i);
-		// cout << "a[" << i << "]=" << a[i] << endl;
+	p = -1;
+	pn = 0;
+	pkeys = NULL;
+	pnodes = NULL;
+	if (packable<T>::value) {
+		pkeys = new T[pmax];
+		pnodes = new Node*[pmax];
 	}
 
 	init(data, n0);
 }
 
+/**
+ * Use eps = e from now on, which sets a[] and, if there can now be more
+ * lists, makes the arrays indexed by list bigger
+ */
 template<class T>
-void TodoList<T>::init(T *data, int n0) {
+void TodoList<T>::setEps(double e) {
+	eps = e;
 
-	// Compute critical values depending on epsilon and n
-	n0max = ceil(2. / eps);
+	int k1 = maxLevel(eps);
+	if (k1 > kmax) {
+		int *rf = new int[k1+1]();
+		size_t *n1 = new size_t[k1+1]();
+		Node **b1 = new Node*[k1+1], **f1 = new Node*[k1+1];
+		if (kmax >= 0) {
+			copy(rebuild_freqs, rebuild_freqs + kmax + 1, rf);
+			copy(n, n + kmax + 1, n1);
+			copy(behind, behind + kmax + 1, b1);  // in case a job is running
+			copy(front, front + kmax + 1, f1);
+		}
+		delete[] rebuild_freqs;
+		delete[] n;
+		delete[] path;
+		delete[] behind;
+		delete[] front;
+		delete[] a;
+		rebuild_freqs = rf;
+		n = n1;
+		path = new Node*[k1+1];
+		behind = b1;
+		front = f1;
+		a = new size_t[k1+1];
+		kmax = k1;
+	}
+	setThresholds(a, kmax, eps);
+}
+
+template<class T>
+void TodoList<T>::init(T *data, size_t n0) {
+	build(data, n0, threadsFor(n0));
+	pack();
+	fingerLevel = k + 1;
+}
+
+/**
+ * Make this list hold sorted[0..m-1], which is sorted and distinct, using
+ * the given number of threads.  Element t goes
+ * into L_{k-d} for every d such that 2^d divides t+1, which is exactly what
+ * rebuild(k) would do.  The nodes come from one run of the arena, so node t
+ * is at a known address and each thread can fill in its own range of nodes
+ * without looking at the others.  That makes a global rebuild one
+ * sequential sweep over memory instead of k walks along linked lists.
+ */
+template<class T>
+void TodoList<T>::build(const T *sorted, size_t m, int threads) {
+	double start = counters.now();
 	n0max = 1;
-	// cout << "n0max = " << n0max << endl;
-	k = max(0.0, ceil(log(n0) / log(2-eps)));
+	cursor = rcursor = NULL;
+	moving = false;
+	spare.clear();
+	k = levels(m);
+	assert(k <= kmax);
+	for (int d = 0; d <= k; d++)
+		n[k-d] = (d < 64) ? m >> d : 0;
 
-	n = new int[k + 1]();
-	// cout << "k = " << k << endl;
-	n[k] = n0;
+	if (autoTune)
+		tuneTouched += m;
+
+	kcap = min(k + headroom, kmax);
+	arena.reset(sizeof(Node) + (kcap + 1) * sizeof(Node*));
 	sentinel = newNode();
-	Node *prev = sentinel;
-	for (int i = 0; i < n0; i++) {
-		Node *u = newNode();
-		u->x = data[i];
-		prev->next[k] = u;
-		prev = u;
+	char *base = (char*)arena.allocRun(m);
+	size_t bs = arena.blockSize();
+	for (int d = 0; d <= k && d < 64; d++) {
+		size_t t = ((size_t)1 << d) - 1;
+		sentinel->next[k-d] = (t < m) ? (Node*)(base + t*bs) : NULL;
 	}
-	rebuild(k);
+
+	auto fill = [=](size_t lo, size_t hi) {
+		for (size_t t = lo; t < hi; t++) {
+			Node *u = (Node*)(base + t*bs);
+			u->x = sorted[t];
+			for (int d = 0; d <= k; d++) {
+				size_t step = (d < 64) ? (size_t)1 << d : 0;
+				bool in = step != 0 && (t+1) % step == 0;
+				u->next[k-d] = (in && t + step < m)
+						? (Node*)(base + (t+step)*bs) : NULL;
+			}
+		}
+	};
+	if (threads <= 1) {
+		fill(0, m);
+	} else {
+		vector<thread> ts;
+		size_t chunk = (m + threads - 1) / threads;
+		for (size_t lo = 0; lo < m; lo += chunk)
+			ts.push_back(thread(fill, lo, min(m, lo + chunk)));
+		for (size_t i = 0; i < ts.size(); i++)
+			ts[i].join();
+	}
+	arena.trim();
+	p = -1;
+	rebuild_freqs[k]++;
+	counters.rebuilt(k, m, start);
 }
 
+/**
+ * Sort data[0..n0-1] into buf and remove duplicates, using nthreads threads.
+ * Each thread sorts one part, then the parts are merged in pairs, in
+ * parallel, for log(nthreads) rounds.  Returns the number of distinct
+ * elements.
+ */
 template<class T>
-typename TodoList<T>::Node* TodoList<T>::newNode() {
-	Node *u = (Node *) malloc(sizeof(Node) + (k + 1) * sizeof(Node*));
+size_t TodoList<T>::sortUnique(const T *data, size_t n0, T *buf,
+		int nthreads) {
+	size_t P = nthreads;
+	vector<size_t> lo(P+1), len(P);
+	for (size_t p = 0; p <= P; p++)
+		lo[p] = min(n0, p * ((n0 + P - 1) / P));
+	vector<thread> threads;
+	for (size_t p = 0; p < P; p++) {
+		threads.push_back(thread([=, &len] {
+			copy(data + lo[p], data + lo[p+1], buf + lo[p]);
+			sort(buf + lo[p], buf + lo[p+1]);
+			len[p] = unique(buf + lo[p], buf + lo[p+1]) - (buf + lo[p]);
+		}));
+	}
+	for (size_t p = 0; p < P; p++)
+		threads[p].join();
+
+	// merge pairs of parts, going back and forth between buf and tmp
+	T *tmp = new T[n0];
+	T *src = buf, *dst = tmp;
+	for (size_t w = 1; w < P; w *= 2) {
+		threads.clear();
+		for (size_t p = 0; p < P; p += 2*w) {
+			threads.push_back(thread([=, &len] {
+				T *out = dst + lo[p];
+				if (p + w < P) {
+					T *b1 = src + lo[p], *b2 = src + lo[p+w];
+					T *end = merge(b1, b1 + len[p], b2, b2 + len[p+w], out);
+					len[p] = unique(out, end) - out;
+				} else {
+					copy(src + lo[p], src + lo[p] + len[p], out);
+				}
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].join();
+		swap(src, dst);
+	}
+	if (src != buf)
+		copy(src, src + len[0], buf);
+	delete[] tmp;
+	return len[0];
+}
+
+/**
+ * Replace the contents of this list with the elements of data[0..n0-1],
+ * which need not be sorted or distinct.  Sorting, deduplicating and
+ * building the lists are all split among nthreads threads (0 means one per
+ * core).
+ */
+template<class T>
+void TodoList<T>::bulkLoad(const T *data, size_t n0, int nthreads) {
+	if (nthreads <= 0)
+		nthreads = max(1u, thread::hardware_concurrency());
+	T *buf = new T[n0];
+	size_t m = sortUnique(data, n0, buf, nthreads);
+	build(buf, m, nthreads);
+	delete[] buf;
+	pack();
+	fingerLevel = k + 1;
+}
+
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::newNode(bool spared) {
+	Node *u = (Node *) (spared ? spare : arena).alloc();
 	memset(u->next, '\0', (k + 1) * sizeof(Node*));
 	return u;
 }
 
 template<class T>
 void TodoList<T>::deleteNode(Node *u) {
-	free(u);
+	if (keepDeleted)
+		return;
+	if (moving && u->x < cursor->x)
+		spare.free(u);  // the job has already moved it
+	else
+		arena.free(u);
 }
 
+/**
+ * Change the number of lists to suit n[k] elements.  As long as the nodes
+ * have room for the new L_k, this just moves the links of L_k there and
+ * rebuilds the lists above it in place, so it allocates nothing and every
+ * element stays where it is.  Only when k grows past kcap, or shrinks so
+ * far that the nodes are mostly wasted space, or most of the arena is
+ * blocks that remove() gave back, do we free everything and start over.
+ */
 template<class T>
 void TodoList<T>::rebuild() {
-	// time to rebuild --- free everything and start over
-	// TODO: Put some padding in so we only do this O(loglog n) times
-	T *data = new T[n[k]];
-	Node *prev = sentinel;
-	Node *u = sentinel->next[k];
-	for (int j = 0; j < n[k]; j++) {
-		data[j] = u->x;
-		deleteNode(prev);
-		prev = u;
-		u = u->next[k];
-	}
-	deleteNode(prev);
-	int enn = n[k];
-	delete[] n;
-	init(data, enn);
-	delete[] data;
+	finishJob();
+	if (autoTune && !incremental)
+		retune();
+	double start = counters.now();
+	size_t m = n[k];
+	int k1 = levels(m);
+	if (k1 > kcap || kcap - k1 > 2*headroom
+			|| arena.bytesReserved() / arena.blockSize() > 4*m + 1024) {
+		T *data = new T[m];
+		Node *u = sentinel->next[k];
+		for (size_t j = 0; j < m; j++) {
+			data[j] = u->x;
+			u = u->next[k];
+		}
+		init(data, m);
+		delete[] data;
+	} else {
+		// the old L_0,...,L_k are still there, and rebuild(k1) may use one
+		// of them to split up its work
+		for (Node *u = sentinel; u != NULL; u = u->next[k1])
+			u->next[k1] = u->next[k];
+		k = k1;
+		n[k] = m;
+		rebuild(k);
+		pack();
+		fingerLevel = k + 1;
+	}
+	counters.rebuiltAll(start);
 }
 
 
+/**
+ * Rebuild L_0,...,L_{i-1} from L_i.  L_j gets every other element of
+ * L_{j+1}, starting with the second, so the element of rank r in L_i ends
+ * up in L_{i-d} for every d such that 2^d divides r+1.  That lets us fill in
+ * all the lists with one walk along L_i.  When L_i is big, it is cut into
+ * pieces at nodes of the old L_c, for a small c, and threads relink the
+ * pieces in parallel.  One walk over every piece counts its nodes, which
+ * gives each piece the rank of its first node, and then a second walk
+ * relinks it.  The pieces are stitched together at the end.
+ */
 template<class T>
 void TodoList<T>::rebuild(int i) {
 
 	rebuild_freqs[i]++;
+	fingerLevel = max(fingerLevel, i);
+	double start = counters.now();
+	bool timed = autoTune && (++tuneRebuilds & 63) == 0;
+	double tstart = timed ? tuneClock() : 0;
+	int threads = threadsFor(n[i]);
 
+	// first[c*i+j] and last[c*i+j] are the ends of piece c's part of L_j
+	vector<Node*> first(threads * i), last(threads * i);
+	if (threads == 1) {
+		relink(i, sentinel->next[i], 0, n[i], first.data(), last.data());
+	} else {
+		// the old L_c is a sorted subset of L_i with a few nodes per thread
+		int c;
+		for (c = 0; c < i - 1 && n[c] < (size_t)4 * threads; c++);
+		vector<Node*> cut(1, sentinel->next[i]);
+		size_t gap = max((size_t)1, n[c] / threads), t = 0;
+		for (Node *u = sentinel->next[c]; u != NULL; u = u->next[c])
+			if (++t % gap == 0 && cut.size() < (size_t)threads
+					&& u != cut.back())
+				cut.push_back(u);
+		cut.push_back(NULL);
+		int pieces = cut.size() - 1;
+
+		vector<size_t> rank(pieces + 1, 0);
+		vector<thread> ts;
+		for (int q = 0; q < pieces; q++) {
+			ts.push_back(thread([=, &rank, &cut] {
+				size_t m = 0;
+				for (Node *u = cut[q]; u != cut[q+1]; u = u->next[i])
+					m++;
+				rank[q+1] = m;
+			}));
+		}
+		for (int q = 0; q < pieces; q++)
+			ts[q].join();
+		for (int q = 0; q < pieces; q++)
+			rank[q+1] += rank[q];
+		ts.clear();
+		for (int q = 0; q < pieces; q++) {
+			ts.push_back(thread([=, &rank, &cut, &first, &last] {
+				relink(i, cut[q], rank[q], rank[q+1] - rank[q],
+						first.data() + q*i, last.data() + q*i);
+			}));
+		}
+		for (int q = 0; q < pieces; q++)
+			ts[q].join();
+		threads = pieces;
+	}
+
+	// stitch the pieces together
 	for (int j = i - 1; j >= 0; j--) {
-		// populate L_j using L_{j+1}
-		n[j] = 0;
-		Node *u = sentinel->next[j + 1];
 		Node *prev = sentinel;
-		bool skipped = false;
-		while (u != NULL) {
-			if (skipped) {
-				prev->next[j] = u;
-				prev = u;
-				n[j]++;
-				skipped = false;
-			} else {
-				skipped = true;
+		for (int q = 0; q < threads; q++) {
+			if (first[q*i+j] != NULL) {
+				setNext(prev, j, first[q*i+j]);
+				prev = last[q*i+j];
 			}
-			u = u->next[j + 1];
 		}
-		prev->next[j] = NULL;
+		setNext(prev, j, NULL);
+		n[j] = (i - j < 64) ? n[i] >> (i - j) : 0;
 	}
 
+	// L_p only changes if it was rebuilt
+	if (i > p)
+		pack();
+	counters.rebuilt(i, n[i], start);
+	if (autoTune) {
+		tuneTouched += n[i];
+		if (timed) {
+			tuneRebuildTime += tuneClock() - tstart;
+			tuneSampled += n[i];
+		}
+	}
 }
 
+/**
+ * Put the m nodes of L_i starting at u, the node of rank r, into the lists
+ * L_0,...,L_{i-1} they belong to.  first[j] and last[j] are set to the
+ * first and last of these nodes in L_j (or NULL), which are left for
+ * rebuild(i) to link up with the rest of L_j.
+ */
 template<class T>
-T TodoList<T>::find(T x) {
+void TodoList<T>::relink(int i, Node *u, size_t r, size_t m, Node **first,
+		Node **last) {
+	fill(first, first + i, (Node*)NULL);
+	fill(last, last + i, (Node*)NULL);
+	for (size_t t = r + 1; t <= r + m; t++, u = u->next[i]) {
+		int d = min(i, __builtin_ctzll(t));
+		for (int j = i - d; j < i; j++) {
+			// u->next[j] may be stale, so clear it before u is reachable
+			setNext(u, j, NULL);
+			if (last[j] == NULL)
+				first[j] = u;
+			else
+				setNext(last[j], j, u);
+			last[j] = u;
+		}
+	}
+}
+
+/**
+ * Refresh the packed copy of L_p, choosing p again
+ */
+template<class T>
+void TodoList<T>::pack() {
+	if (pkeys == NULL || cursor != NULL || rcursor != NULL) return;
+	for (p = k; p >= 0 && n[p] > (size_t)pmax; p--);
+	if (p < 0) return;
+	pn = 0;
+	for (Node *u = sentinel->next[p]; u != NULL; u = u->next[p]) {
+		pkeys[pn] = u->x;
+		pnodes[pn++] = u;
+	}
+	for (size_t j = pn; j < (size_t)pmax; j++)
+		pkeys[j] = numeric_limits<T>::max();
+}
+
+/**
+ * Return the last node in L_p that is less than x, which is where the usual
+ * search would be after looking at L_0,...,L_p
+ */
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::packedPred(T x) {
+	size_t r = packedRank(pkeys, pmax, x);
+	r = (r > pn) ? pn : r;  // in case x is bigger than the padding
+	return (r == 0) ? sentinel : pnodes[r-1];
+}
+
+/**
+ * Return the last node of L_k that is less than x, which may be sentinel
+ */
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::findPredNode(T x) {
+	if (incremental)
+		return path[walk(x, true)];
 	Node *u = sentinel;
-	for (int i = 0; i <= k; i++) {
-		if (u->next[i] != NULL && u->next[i]->x < x)
+	int i = 0;
+	if (p >= 0) {
+		for (size_t b = 0; b < pmax * sizeof(T); b += 64)
+			counters.touch((char*)pkeys + b);
+		u = packedPred(x);
+		counters.touch(&pnodes[0]);  // roughly, since pnodes[] is small
+		counters.compare();  // one SIMD search counts as one comparison
+		i = p + 1;
+	}
+	for (; i <= k; i++) {
+		counters.touch(&u->next[i]);
+		if (u->next[i] != NULL)
+			counters.touch(&u->next[i]->x);
+		if (precedes(u->next[i], x))
 			u = u->next[i];
 		//if (u->next[i] != NULL && u->next[i]->x == x) return u->next[i]->x;
 	}
-	Node *w = u->next[k];
+	return u;
+}
+
+/**
+ * Return the node containing the smallest value >= x, or NULL
+ */
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::findNode(T x) {
+	finishJob();  // so the answer is on L_k
+	return findPredNode(x)->next[k];
+}
+
+template<class T>
+T TodoList<T>::find(T x) {
+	counters.find();
+	Node *w;
+	if (incremental) {
+		advance();  // first, since a job may move nodes and free the old ones
+		int b = walk(x, true);
+		w = path[b]->next[b];
+	} else if (autoTune) {
+		w = tunedFind(x);
+	} else {
+		w = findNode(x);
+	}
 	return (w == NULL) ? (T)NULL : w->x;
 }
 
+/**
+ * findNode(x), timing every 256th search for retune()
+ */
 template<class T>
-bool TodoList<T>::add(T x) {
-	// do a search for x and keep track of the search path
-	Node *path[50]; // FIXME: hard upper-bound
+typename TodoList<T>::Node* TodoList<T>::tunedFind(T x) {
+	if ((++tuneReads & 255) != 0)
+		return findNode(x);
+	tuneIfDue();
+	double start = tuneClock();
+	Node *w = findNode(x);
+	tuneFindTime += tuneClock() - start;
+	tuneFinds++;
+	return w;
+}
+
+/**
+ * Choose eps again, from the measurements described with autoTune, and
+ * return true if it changed.  The model is only trusted near the eps it
+ * was measured at, so eps moves by at most a factor of two at a time, and
+ * only if that is predicted to save 5%.
+ */
+template<class T>
+bool TodoList<T>::retune() {
+	size_t ops = tuneReads + tuneWrites;
+	if (ops < tuneMinOps || tuneFinds == 0
+			|| (tuneWrites > 0 && tuneSampled == 0))
+		return false;
+	double lg = log(max((double)size(), 2.0));
+	double list = tuneFindTime / tuneFinds / (lg / log(2-eps));
+	double touch = (tuneSampled > 0) ? tuneRebuildTime / tuneSampled : 0;
+	// the time per operation spent in rebuild(i), times eps
+	double update = touch * tuneTouched / ops * eps;
+	double e0 = eps, best = eps;
+	double cost = list * lg / log(2-eps) + update / eps, bestCost = cost;
+	for (int s = -8; s <= 8; s++) {
+		double e = e0 * pow(2.0, s / 8.0);
+		if (e < epsMin || e > epsMax)
+			continue;
+		double c = list * lg / log(2-e) + update / e;
+		if (c < bestCost) {
+			best = e;
+			bestCost = c;
+		}
+	}
+	resetTuning();
+	if (best == e0 || bestCost > .95 * cost)
+		return false;
+	setEps(best);
+	return true;
+}
+
+/**
+ * Like find(x), but start from the finger.  If x is in the same gap of
+ * L_{k-d} as the finger, this takes O(d) time instead of O(log n).  A key g
+ * elements past the last one added or looked for with findNear() usually
+ * shares a gap of L_{k-O(log g)} with it, but can be just past a node of a
+ * much smaller list, and then it gets a normal search.
+ */
+template<class T>
+T TodoList<T>::findNear(T x) {
+	if (incremental)
+		return find(x);
+	counters.find();
+	Node *w = fingerSearch(x)->next[k];
+	return (w == NULL) ? (T)NULL : w->x;
+}
+
+/**
+ * Is path[i] the last node of L_i that is less than x?
+ */
+template<class T>
+bool TodoList<T>::fingerAgrees(int i, T x) {
+	Node *u = path[i];
+	return (u == sentinel || u->x < x)
+			&& !precedes(u->next[i], x);
+}
+
+/**
+ * Return the first j > fingerLevel such that the finger is wrong for x on
+ * L_j, or 0 if the finger isn't worth using for x
+ *
+ * path[i] only gets bigger and path[i]->next[i] only gets smaller as i
+ * grows, so the finger is right for x on L_f,...,L_{j-1} and wrong below
+ * that.  We climb from L_k, doubling the distance each time, until the
+ * finger agrees with x, and then binary search, so finding j = k-d takes
+ * O(log d) comparisons.  If the finger doesn't save at least half of the
+ * lists it is only tried again on every 16th search.
+ */
+template<class T>
+int TodoList<T>::fingerStart(T x) {
+	if (fingerLevel > k || !(fingerOn || (++fingerTries & 15) == 0))
+		return 0;
+	fingerOn = true;
+	if (fingerAgrees(k, x))
+		return k + 1;  // x goes right after path[k], like an append
+	int lo, hi = k;
+	for (int d = 1; ; d *= 2) {
+		lo = max(k - d, fingerLevel);
+		if (fingerAgrees(lo, x))
+			break;
+		if (lo == fingerLevel) {
+			fingerOn = false;
+			return 0;
+		}
+		hi = lo;
+	}
+	while (hi - lo > 1) {
+		int i = (lo + hi) / 2;
+		if (fingerAgrees(i, x))
+			lo = i;
+		else
+			hi = i;
+	}
+	fingerOn = 2*(k - hi) <= k - fingerLevel;
+	return hi;
+}
+
+/**
+ * Record the search path for x in path[], starting from the finger if that
+ * helps, and return path[k]
+ */
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::fingerSearch(T x) {
+	int j = fingerStart(x);
+	int top = (j > 0) ? fingerLevel : k + 1;
+
+	// lists above the finger, or all of them if we can't use it
 	Node *u = sentinel;
 	int i;
-	for (i = 0; i <= k; i++) {
-		if (u->next[i] != NULL && u->next[i]->x < x)
+	for (i = 0; i < top; i++) {
+		if (precedes(u->next[i], x))
 			u = u->next[i];
 		path[i] = u;
 	}
 
+	// lists below where x and the finger part ways
+	if (j > 0) {
+		u = path[j-1];
+		for (i = j; i <= k; i++) {
+			if (precedes(u->next[i], x))
+				u = u->next[i];
+			path[i] = u;
+		}
+	}
+	fingerLevel = 0;
+	return u;
+}
+
+/**
+ * Set out[j] = find(keys[j]) for j = 0,...,m-1
+ *
+ * Every step of a search is a dependent (and usually missed) load, so this
+ * runs g searches at once, round-robin, one level at a time.  When a search
+ * moves to its next level it prefetches the node it will compare against
+ * there, and that load has the other g-1 steps to complete.
+ */
+template<class T>
+void TodoList<T>::findMany(const T *keys, T *out, size_t m, int g) {
+	if (incremental) {
+		for (size_t j = 0; j < m; j++)
+			out[j] = find(keys[j]);
+		return;
+	}
+	Node *u[gmax];  // the search in slot s is at u[s]
+	int lev[gmax];  // about to look at L_{lev[s]}, or idle if lev[s] > k
+	size_t idx[gmax];  // and is looking for keys[idx[s]]
+	g = max(1, min(g, gmax));
+	for (int s = 0; s < g; s++)
+		lev[s] = k + 1;
+
+	size_t j = 0;
+	bool busy = true;
+	while (busy) {
+		busy = false;
+		for (int s = 0; s < g; s++) {
+			T x;
+			if (lev[s] > k) {
+				// slot s is idle, so start the next search in it
+				if (j == m) continue;
+				idx[s] = j++;
+				x = keys[idx[s]];
+				u[s] = sentinel;
+				lev[s] = 0;
+				if (p >= 0) {
+					u[s] = packedPred(x);
+					lev[s] = p + 1;
+				}
+			} else {
+				x = keys[idx[s]];
+				Node *w = u[s]->next[lev[s]];
+				if (w != NULL && w->x < x)
+					u[s] = w;
+				lev[s]++;
+			}
+			busy = true;
+			if (lev[s] <= k) {
+				__builtin_prefetch(u[s]->next[lev[s]]);
+			} else {
+				Node *w = u[s]->next[k];
+				out[idx[s]] = (w == NULL) ? (T)NULL : w->x;
+			}
+		}
+	}
+}
+
+/**
+ * Set out[j] = find(keys[j]) for j = 0,...,m-1, where keys is sorted
+ *
+ * path[i] is kept from one search to the next.  path[i]->next[i] is the
+ * successor of the previous key in L_i, which can only get smaller as i
+ * grows, so the search for x agrees with the previous one on every list
+ * before the first L_j where that successor is less than x.  We find j by
+ * galloping up from L_k and restart the search on L_j from path[j-1].  For
+ * keys that are g apart in L_k this costs O(log g) comparisons.
+ */
+template<class T>
+void TodoList<T>::findSorted(const T *keys, T *out, size_t m) {
+	if (incremental) {
+		for (size_t t = 0; t < m; t++)
+			out[t] = find(keys[t]);
+		return;
+	}
+	fingerLevel = k + 1;  // we use path[] differently
+	int b = max(p, 0);  // path[i] is only kept for i >= b
+	for (size_t t = 0; t < m; t++) {
+		T x = keys[t];
+		assert(t == 0 || !(x < keys[t-1]));
+
+		// the first j >= b with path[j]->next[j] < x, or k+1 if there isn't one
+		int i, j = b;
+		if (t > 0) {
+			j = k + 1;
+			if (path[k]->next[k] != NULL && path[k]->next[k]->x < x) {
+				int lo = b - 1, hi = k;
+				for (int step = 1; k - step >= b; step *= 2) {
+					i = k - step;
+					if (path[i]->next[i] == NULL || !(path[i]->next[i]->x < x)) {
+						lo = i;
+						break;
+					}
+					hi = i;
+				}
+				while (hi - lo > 1) {
+					i = (lo + hi) / 2;
+					if (path[i]->next[i] != NULL && path[i]->next[i]->x < x)
+						hi = i;
+					else
+						lo = i;
+				}
+				j = hi;
+			}
+		}
+
+		// the rest is the usual search, starting at L_j
+		Node *u;
+		if (j == b) {
+			u = sentinel;
+			i = 0;
+			if (p >= 0) {
+				u = path[p] = packedPred(x);
+				i = p + 1;
+			}
+		} else {
+			u = path[j-1];
+			i = j;
+		}
+		for (; i <= k; i++) {
+			if (u->next[i] != NULL && u->next[i]->x < x)
+				u = u->next[i];
+			path[i] = u;
+		}
+		Node *w = u->next[k];
+		out[t] = (w == NULL) ? T() : w->x;
+	}
+}
+
+/**
+ * Return the largest value less than x, or (T)NULL if there isn't one
+ */
+template<class T>
+T TodoList<T>::predecessor(T x) {
+	Node *u = findPredNode(x);
+	return (u == sentinel) ? (T)NULL : u->x;
+}
+
+/**
+ * Return an iterator pointing at the smallest value >= x
+ */
+template<class T>
+typename TodoList<T>::Iterator TodoList<T>::lowerBound(T x) {
+	return Iterator(findNode(x), k);
+}
+
+/**
+ * Return an iterator pointing at the smallest value > x
+ */
+template<class T>
+typename TodoList<T>::Iterator TodoList<T>::upperBound(T x) {
+	Node *w = findNode(x);
+	if (w != NULL && !(x < w->x))
+		w = w->next[k];
+	return Iterator(w, k);
+}
+
+/**
+ * Call f(y) for every y in [lo, hi), in increasing order, and return the
+ * number of calls.  This is one search for lo followed by a walk along L_k.
+ * Nodes made by the same rebuild are next to each other in the arena, but
+ * nodes added since can be anywhere, so a second pointer, v, runs a few
+ * nodes ahead of u and prefetches them.  That way f(u->x) overlaps with the
+ * misses on the nodes that come next.
+ */
+template<class T> template<class F>
+size_t TodoList<T>::rangeScan(T lo, T hi, F f) {
+	const int ahead = 4;
+	Node *u = findNode(lo);
+	Node *v = u;
+	for (int j = 0; j < ahead && v != NULL; j++)
+		v = v->next[k];
+	size_t count = 0;
+	for (; u != NULL && u->x < hi; u = u->next[k]) {
+		if (v != NULL) {
+			v = v->next[k];  // prefetched by the last iteration
+			if (v != NULL)
+				__builtin_prefetch(v);
+		}
+		f(u->x);
+		count++;
+	}
+	return count;
+}
+
+template<class T>
+bool TodoList<T>::add(T x) {
+	if (incremental)
+		return addIncremental(x);
+	counters.add();
+	if (autoTune) {
+		tuneWrites++;
+		tuneIfDue();
+	}
+	// do a search for x and keep track of the search path
+	int i;
+	Node *u = fingerSearch(x);
+
 	// check if x is already here and, if so, abort
 	Node *w = u->next[k];
 	if (w != NULL && w->x == x)
 		return false;
 
-	// insert x everywhere along the search path
 	w = newNode();
 	w->x = x;
-	for (i = k; i >= 0; i--) {
-		w->next[i] = path[i]->next[i];
-		path[i]->next[i] = w;
-		n[i]++;
+	if (u->next[k] == NULL) {
+		// x is bigger than everything, so path[i] is the last node of L_i.
+		// Add x to L_k and then, like a binary counter, carry it up into
+		// each L_i whose last node is followed by an extra node of L_{i+1}.
+		// This keeps every gap small and touches O(1) lists (amortized).
+		Node *last = path[k];  // the old last node of L_{i+1}
+		setNext(path[k], k, w);
+		path[k] = w;
+		n[k]++;
+		for (i = k - 1; i >= 0 && last != path[i]; i--) {
+			last = path[i];
+			setNext(path[i], i, w);
+			path[i] = w;
+			n[i]++;
+		}
+	} else {
+		// insert x everywhere along the search path, which leaves the
+		// finger on the new node, ready for a bigger key
+		for (i = k; i >= 0; i--) {
+			w->next[i] = path[i]->next[i];
+			setNext(path[i], i, w);
+			path[i] = w;
+			n[i]++;
+		}
+	}
+
+	// keep the packed copy of L_p up to date
+	if (p >= 0 && i < p) {
+		if (n[p] > (size_t)pmax) {
+			pack();
+		} else {
+			size_t r = packedRank(pkeys, pmax, x);
+			r = (r > pn) ? pn : r;
+			copy_backward(pkeys + r, pkeys + pn, pkeys + pn + 1);
+			copy_backward(pnodes + r, pnodes + pn, pnodes + pn + 1);
+			pkeys[r] = x;
+			pnodes[r] = w;
+			pn++;
+		}
 	}
 
 	// check if we need to add another level on the bottom
@@ -227,18 +1239,505 @@ bool TodoList<T>::add(T x) {
 	return true;
 }
 
+/**
+ * Add the elements in the sorted range [first,last) and return the number
+ * of them that weren't already here.  Each element is found by a finger
+ * search from the previous one, so it costs O(log g) where g is the number
+ * of elements of L_k between the two.  Every new element goes into every
+ * list, and a single partial (or global) rebuild at the end restores the
+ * list sizes.
+ */
+template<class T> template<class Iter>
+size_t TodoList<T>::addBatch(Iter first, Iter last) {
+	size_t added = 0;
+	if (incremental) {
+		for (; first != last; ++first)
+			added += add(*first);
+		return added;
+	}
+	fingerLevel = k + 1;  // we use path[] differently
+	Node *f = sentinel;  // the finger, which is in every list
+	for (; first != last; ++first) {
+		T x = *first;
+		if (f != sentinel && f->x == x)
+			continue;  // a repeat within the batch
+
+		// f->next[i] >= x for i < j, and f->next[i] < x for i >= j, so
+		// find j by galloping up from L_k and then doing a binary search
+		int i, j = k + 1;
+		if (f->next[k] != NULL && f->next[k]->x < x) {
+			int lo = -1, hi = k;
+			for (int step = 1; k - step >= 0; step *= 2) {
+				i = k - step;
+				if (f->next[i] == NULL || !(f->next[i]->x < x)) {
+					lo = i;
+					break;
+				}
+				hi = i;
+			}
+			while (hi - lo > 1) {
+				i = (lo + hi) / 2;
+				if (f->next[i] != NULL && f->next[i]->x < x)
+					hi = i;
+				else
+					lo = i;
+			}
+			j = hi;
+		}
+		for (i = 0; i < j; i++)
+			path[i] = f;
+
+		// Now the usual search, starting at L_j.  Only L_0 can have big gaps
+		// in the middle of a batch, everything else has one comparison.
+		Node *u = f;
+		if (j == 0) {
+			while (u->next[0] != NULL && u->next[0]->x < x)
+				u = u->next[0];
+			path[0] = u;
+		} else if (j <= k) {
+			u = path[j] = f->next[j];
+		}
+		for (i = j + 1; i <= k; i++) {
+			if (u->next[i] != NULL && u->next[i]->x < x)
+				u = u->next[i];
+			path[i] = u;
+		}
+
+		// check if x is already here and, if so, skip it
+		Node *w = u->next[k];
+		if (w != NULL && w->x == x)
+			continue;
+
+		// insert x everywhere along the search path
+		w = newNode();
+		w->x = x;
+		for (i = k; i >= 0; i--) {
+			w->next[i] = path[i]->next[i];
+			path[i]->next[i] = w;
+			n[i]++;
+		}
+		f = w;
+		added++;
+	}
+	if (autoTune)
+		tuneWrites += added;
+
+	if (n[k] > a[k]) {
+		rebuild();
+	} else {
+		// rebuild everything above the last list that is too big
+		int i;
+		for (i = k - 1; i >= 0 && n[i] <= a[i]; i--);
+		if (i >= 0)
+			rebuild(i + 1);
+		pack();
+	}
+	return added;
+}
+
+template<class T>
+bool TodoList<T>::remove(T x) {
+	if (incremental)
+		return removeIncremental(x);
+	counters.remove();
+	if (autoTune) {
+		tuneWrites++;
+		tuneIfDue();
+	}
+	fingerLevel = k + 1;  // we use path[] differently
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (precedes(u->next[i], x))
+			u = u->next[i];
+		path[i] = u;
+	}
+
+	// check if x is here and, if not, abort
+	Node *w = u->next[k];
+	if (w == NULL || !(w->x == x))
+		return false;
+
+	// unlink w from every list it appears in
+	for (i = 0; i <= k; i++) {
+		if (path[i]->next[i] == w) {
+			setNext(path[i], i, w->next[i]);
+			n[i]--;
+		}
+	}
+	deleteNode(w);
+
+	// Removing w may have merged two gaps so that some L_i gap now contains
+	// two or three elements of L_{i+1}.  Fix this by promoting the second of
+	// these into L_i.  This only changes the L_{i-1} gap that starts at
+	// path[i-1], so one pass from L_{k-1} up to L_0 fixes everything.
+	for (i = k - 1; i >= 0; i--) {
+		Node *end = path[i]->next[i];
+		Node *v = path[i]->next[i+1];
+		if (v == end || v->next[i+1] == end)
+			continue;
+		v = v->next[i+1];
+		setNext(v, i, end);
+		setNext(path[i], i, v);
+		n[i]++;
+	}
+
+	pack();
+
+	// check if we need to remove a level from the bottom
+	if (k > 1 && n[k] < a[k-2])
+		rebuild();
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+/**
+ * The search used in incremental mode.  A gap of L_i can hold up to gapMax
+ * nodes of L_{i+1}, so this walks along each list.  It records the path in
+ * path[] and returns the last list it used, which is k, or k+1 if x is
+ * behind the cursor of a job.  If packed is set, it starts from the packed
+ * copy of L_p and path[0..p-1] aren't filled in.
+ */
+template<class T>
+int TodoList<T>::walk(T x, bool packed) {
+	Node *u = sentinel;
+	int i = 0;
+	if (packed && p >= 0) {
+		u = path[p] = packedPred(x);
+		counters.compare();
+		i = p + 1;
+	}
+	for (; i <= k; i++) {
+		while (precedes(u->next[i], x))
+			u = u->next[i];
+		path[i] = u;
+	}
+	if (cursor == NULL || !(u == sentinel || u->x < cursor->x))
+		return k;
+	while (precedes(u->next[k+1], x))
+		u = u->next[k+1];
+	path[k+1] = u;
+	return k + 1;
+}
+
+/**
+ * Return the number of nodes of L_{i+1} that are strictly between path[i]
+ * and path[i]->next[i], and set mid to the middle one
+ */
+template<class T>
+int TodoList<T>::gap(int i, Node **mid) {
+	Node *end = path[i]->next[i];
+	int c = 0;
+	for (Node *v = path[i]->next[i+1]; v != end; v = v->next[i+1])
+		c++;
+	*mid = path[i]->next[i+1];
+	for (int j = 1; j < (c + 1) / 2; j++)
+		*mid = (*mid)->next[i+1];
+	return c;
+}
+
+/**
+ * Put v, a node of L_{i+1} in the gap of L_i that starts at path[i], into L_i
+ */
+template<class T>
+void TodoList<T>::promote(int i, Node *v) {
+	setNext(v, i, path[i]->next[i]);
+	setNext(path[i], i, v);
+	n[i]++;
+	linked(i, v);
+}
+
+/**
+ * Tell the job, if there is one, that v was just linked into L_i right after
+ * path[i]
+ */
+template<class T>
+void TodoList<T>::linked(int i, Node *v) {
+	if (cursor != NULL) {
+		if (path[i] == behind[i] && v->x < cursor->x)
+			behind[i] = v;
+	} else if (rcursor != NULL && i < ri && path[i] == behind[i]) {
+		if (v->x < rcursor->x)
+			behind[i] = v;
+		else
+			front[i] = v;  // v is in the old part of L_i
+	}
+}
+
+/**
+ * Tell the job, if there is one, that w was just unlinked from L_i, where
+ * it came right after path[i]
+ */
+template<class T>
+void TodoList<T>::unlinked(int i, Node *w) {
+	if (cursor == NULL && rcursor == NULL)
+		return;
+	if (w == behind[i])
+		behind[i] = path[i];
+	if (rcursor != NULL && i < ri && w == front[i])
+		front[i] = w->next[i];
+}
+
+/**
+ * add(x) in incremental mode.  x goes into the bottom list and is carried up
+ * like in a binary counter: if its gap in L_i now holds gapMax nodes of
+ * L_{i+1}, the middle one is promoted into L_i, which adds a node to a gap
+ * of L_{i-1}, and so on up to the first gap that isn't full.  A rebuild
+ * leaves one node in every gap, so a carry out of L_i takes about 2^(k-i)
+ * additions in the same place.  L_k gets to a[k], and the job adds a list,
+ * long before L_0 fills up.  Anything more is left to schedule().
+ */
+template<class T>
+bool TodoList<T>::addIncremental(T x) {
+	counters.add();
+	int b = walk(x, false);
+	Node *w = path[b]->next[b];
+	if (w != NULL && w->x == x) {
+		advance();
+		return false;
+	}
+
+	w = newNode(moving && b == k + 1);
+	w->x = x;
+	w->next[b] = path[b]->next[b];
+	setNext(path[b], b, w);
+	n[b]++;
+	linked(b, w);
+	if (b == k && cursor != NULL)
+		n[k+1]++;  // which counts everything while there is a job
+	int i;
+	Node *mid;
+	for (i = b - 1; i >= 0 && gap(i, &mid) >= gapMax; i--)
+		promote(i, mid);
+	if (p >= 0 && i < p)
+		pack();
+
+	schedule();
+	advance();
+	return true;
+}
+
+/**
+ * remove(x) in incremental mode.  Unlinking x merges its gaps, so, like
+ * remove(x), one pass up the search path promotes the middle node of every
+ * gap that is full.  Going down to k lists is still a global rebuild.
+ */
+template<class T>
+bool TodoList<T>::removeIncremental(T x) {
+	counters.remove();
+	int b = walk(x, false);
+	Node *w = path[b]->next[b];
+	if (w == NULL || !(w->x == x)) {
+		advance();
+		return false;
+	}
+	if (w == cursor || w == rcursor) {
+		// so the job doesn't lose its place (step() may also move w)
+		if (cursor != NULL)
+			step();
+		else
+			rebuildStep();
+		b = walk(x, false);
+		w = path[b]->next[b];
+	}
+
+	int i;
+	for (i = 0; i <= b; i++) {
+		if (path[i]->next[i] == w) {
+			setNext(path[i], i, w->next[i]);
+			n[i]--;
+			unlinked(i, w);
+		}
+	}
+	if (cursor != NULL && b == k)
+		n[k+1]--;
+	deleteNode(w);
+	Node *mid;
+	for (i = b - 1; i >= 0; i--)
+		if (gap(i, &mid) >= gapMax)
+			promote(i, mid);
+	pack();
+
+	if (k > 1 && size() < a[k-2])
+		rebuild();
+	schedule();
+	advance();
+	return true;
+}
+
+/**
+ * Start a job if one is needed and none is running: another list if L_k has
+ * outgrown a[k], or else a rebuild of the lists above the first L_i that
+ * hasn't outgrown a[i] if L_0 has more than gapMax nodes
+ */
+template<class T>
+void TodoList<T>::schedule() {
+	if (cursor != NULL || rcursor != NULL)
+		return;
+	if (n[k] > a[k]) {
+		startJob();
+	} else if (k > 0 && n[0] > (size_t)gapMax) {
+		int i;
+		for (i = 1; i < k && n[i] > a[i]; i++);
+		startRebuild(i);
+	}
+}
+
+/**
+ * Start the job that goes from k+1 to k+2 lists.  The old L_k becomes
+ * L_{k+1}, and the job thins L_k out to every other node (and every node of
+ * L_{k-1}).  Behind the cursor, L_k is thin and next[k+1] is set; from the
+ * cursor on, L_k still has everything, which is why walk() only looks at
+ * L_{k+1} behind the cursor.  If k is already kcap, the nodes ahead of the
+ * cursor have no next[k+1], so the job moves every node it passes into a
+ * bigger one from spare, starting with the sentinel.
+ */
+template<class T>
+void TodoList<T>::startJob() {
+	moving = k + 1 > kcap;
+	if (moving) {
+		kcap = min(k + 1 + headroom, kmax);
+		spare.reset(sizeof(Node) + (kcap + 1) * sizeof(Node*));
+		Node *s = newNode(true);
+		copy(sentinel->next, sentinel->next + k + 1, s->next);
+		sentinel = s;  // the old one goes when the old arena does
+	}
+	cursor = sentinel->next[k];
+	sentinel->next[k+1] = cursor;
+	fill(behind, behind + k + 2, sentinel);
+	n[k+1] = n[k];
+	p = -1;
+}
+
+/**
+ * Copy v, the node at the cursor, into a node from spare and link the copy
+ * in its place.  The last node before v in any list is behind the job, so
+ * it is behind[j] for every L_j that v is in.
+ */
+template<class T>
+typename TodoList<T>::Node* TodoList<T>::move(Node *v) {
+	Node *u = newNode(true);
+	u->x = v->x;
+	copy(v->next, v->next + k + 1, u->next);
+	for (int j = 0; j <= k + 1; j++)
+		if (behind[j]->next[j] == v)
+			setNext(behind[j], j, u);
+	return u;
+}
+
+/**
+ * Move the job past the node at the cursor, and finish it if that was the
+ * last one
+ */
+template<class T>
+void TodoList<T>::step() {
+	Node *v = cursor;
+	if (moving)
+		v = move(v);
+	cursor = v->next[k];
+	v->next[k+1] = cursor;
+	behind[k+1] = v;
+	int j;
+	for (j = k - 1; j >= 0 && behind[j]->next[j] == v; j--)
+		behind[j] = v;
+	bool up = k > 0 && behind[k-1] == v;
+	if (up || behind[k]->next[k+1] != v) {
+		behind[k] = v;
+	} else {
+		setNext(behind[k], k, cursor);
+		n[k]--;
+	}
+	if (cursor == NULL) {
+		k++;
+		if (moving) {
+			arena.swap(spare);  // every node in spare has been moved
+			moving = false;
+		}
+		rebuild_freqs[k]++;
+		pack();
+	}
+}
+
+/**
+ * Start the job that does rebuild(i) a node at a time.  The nodes of L_i
+ * are taken in order and the node of rank r goes into the same lists as in
+ * rebuild(i), at the end of the new part of each L_j.  The new part is
+ * always linked to what is left of the old one, so every L_j stays sorted
+ * and a subset of L_{j+1} while the job runs.
+ */
+template<class T>
+void TodoList<T>::startRebuild(int i) {
+	ri = i;
+	rrank = 0;
+	rcursor = sentinel->next[i];
+	for (int j = 0; j < i; j++) {
+		behind[j] = sentinel;
+		front[j] = sentinel->next[j];
+	}
+	p = -1;
+}
+
+/**
+ * Move the rebuild job past the node at rcursor, and finish it if that was
+ * the last one
+ */
+template<class T>
+void TodoList<T>::rebuildStep() {
+	Node *u = rcursor;
+	rcursor = u->next[ri];
+	int j;
+	for (j = 0; j < ri; j++) {
+		if (front[j] == u) {
+			front[j] = u->next[j];
+			n[j]--;
+		}
+	}
+	int d = min(ri, __builtin_ctzll(++rrank));
+	for (j = ri - d; j < ri; j++) {
+		setNext(behind[j], j, u);
+		behind[j] = u;
+		n[j]++;
+	}
+	for (j = 0; j < ri; j++)
+		setNext(behind[j], j, front[j]);
+	if (rcursor == NULL) {
+		rebuild_freqs[ri]++;
+		pack();
+	}
+}
+
+/**
+ * Finish any job and, in incremental mode, rebuild L_0,...,L_{k-1} so that
+ * every gap holds one node again, which searches with one comparison per
+ * list need
+ */
+template<class T>
+void TodoList<T>::tighten() {
+	finishJob();
+	spare.clear();  // advance() won't be called to do it
+	if (incremental && k > 0)
+		rebuild(k);
+	fingerLevel = k + 1;
+}
+
 template<class T>
 TodoList<T>::~TodoList() {
 	delete[] n;
 	delete[] a;
+	delete[] path;
+	delete[] behind;
+	delete[] front;
+	delete[] pkeys;
+	delete[] pnodes;
 	delete[] rebuild_freqs;
-	Node *prev = sentinel;
-	while (prev != NULL) {
-		Node *u = prev->next[k];
-		prev->next[k] = NULL;
-		deleteNode(prev);
-		prev = u;
-	}
+	// the arena frees all the nodes at once
 }
 
 template<class T>
@@ -246,7 +1745,7 @@ void TodoList<T>::sanity() {
 	assert(n[0] <= n0max);
 	for (int i = 0; i <= k; i++) {
 		Node *u = sentinel;
-		for (int j = 0; j < n[i]; j++) {
+		for (size_t j = 0; j < n[i]; j++) {
 			assert(u == sentinel || u->x < u->next->x);
 			u = u->next[i];
 		}
@@ -254,15 +1753,37 @@ void TodoList<T>::sanity() {
 	}
 }
 
+template<class T>
+Stats TodoList<T>::stats() {
+	Stats s;
+	s.structure = "TodoList";
+	s.n = size();
+	s.k = k;
+	s.eps = eps;
+	s.bytesUsed = bytesUsed();
+	s.levels.resize(k + 1);
+	for (int i = 0; i <= k; i++) {
+		LevelStats &l = s.levels[i];
+		l.size = n[i];
+		l.maxSize = a[i];
+		l.bound = (i == 0) ? n0max : a[i];
+		l.rebuilds = rebuild_freqs[i];
+		l.touched = 0;
+		l.seconds = 0;
+	}
+	counters.fill(s);
+	return s;
+}
+
 template<class T>
 void TodoList<T>::printOn(std::ostream &out) {
-	const int max_print = 50;
+	const size_t max_print = 50;
 	cout << "WSSkiplist: n = " << n[k] << ", k = " << k << endl;
 	for (int i = 0; i <= k; i++) {
 		cout << "L(" << i << "): ";
 		if (n[k] <= max_print) {
 			Node *u = sentinel->next[i];
-			for (int j = 0; j < n[i]; j++) {
+			for (size_t j = 0; j < n[i]; j++) {
 				cout << u->x << ",";
 				u = u->next[i];
 			}
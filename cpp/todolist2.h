@@ -19,11 +19,16 @@
 #include <cstring>
 #include <cstdlib>
 #include <climits>
+#include <cstdint>
 #include <cassert>
 
 #include <iostream>
+#include <algorithm>
 using namespace std;
 
+#include "stats.h"
+#include "thresholds.h"
+
 namespace fastws {
 
 template<class T>
@@ -37,21 +42,35 @@ protected:
 	};
 
 	int k;    // there are k+1 lists numbered 0,...,k
-	int *n;   // n[i] is the size of the i'th list
+	int kmax; // k never gets bigger than this
+	size_t *n;   // n[i] is the size of the i'th list
 	Node *sentinel; // sentinel-next[i] is the first element of list i
 	Node *sentinel2;
 
 	// parameters used to determine lists sizes
 	double eps;
-	int n0max;
-	int *a;
+	size_t n0max;
+	size_t *a;
 
 	T t_max;
 
-	// FIXME: for profiling information
+	// scratch space for recording search paths
+	Node **path;
+
+	// findMany(keys, out, m, g) interleaves at most gmax searches
+	static constexpr int gmax = 32;
+
+	// rebuild_freqs[i] is the number of calls to rebuild(i), for stats()
 	int *rebuild_freqs;
+	StatCounters counters;
 
-	void init(T *data, int n);
+	// is w's key less than x? (this is what stats() counts)
+	bool precedes(Node *w, T x) {
+		counters.compare();
+		return w->x < x;
+	}
+
+	void init(T *data, size_t n);
 	void rebuild();
 	void rebuild(int i);
 
@@ -61,54 +80,59 @@ protected:
 	void deleteNode(Node *u);
 
 public:
-	TodoList2(T *data, int n0, double eps0, T max0);
+	TodoList2(T *data, size_t n0, double eps0, T max0);
 	virtual ~TodoList2();
 	T find(T x);
+	void findMany(const T *keys, T *out, size_t m, int g = 8);
 	bool add(T x);
-	int size() {
+	size_t size() {
 		return n[k];
 	}
+	size_t bytesUsed() {
+		return (n[k] + 2) * (sizeof(Node) + (k + 1) * sizeof(Node*))
+				+ sizeof(*this) + (k+1)*sizeof(size_t)
+				+ (kmax+1)*(sizeof(size_t) + sizeof(Node*) + sizeof(int));
+	}
+	Stats stats();
+	void resetStats() {
+		counters.reset();
+	}
 
 	void printOn(std::ostream &out);
 };
 
 template<class T>
-TodoList2<T>::TodoList2(T *data, int n0, double eps0, T max0) {
+TodoList2<T>::TodoList2(T *data, size_t n0, double eps0, T max0) {
 	eps = eps0;
 	t_max = max0;
 
-	int kmax = 100; // FIXME: potential limitation here
+	kmax = maxLevel(eps) + 1;
 	rebuild_freqs = new int[kmax+1]();
-	double base_a = 2.0-eps;
-	a = new int[kmax+1];
-	//int offset = ceil(log(n0max)/log(base_a))-1;
-	int offset = 0;
-	k -= offset;
-	for (int i = 0; i <= kmax; i++) {
-		a[i] = pow(base_a, i+offset);
-		// cout << "a[" << i << "]=" << a[i] << endl;
-	}
+	path = new Node*[kmax+1];
+	a = new size_t[kmax+1];
+	setThresholds(a, kmax, eps);
 
 	init(data, n0);
 }
 
 template<class T>
-void TodoList2<T>::init(T *data, int n0) {
+void TodoList2<T>::init(T *data, size_t n0) {
 
 	// Compute critical values depending on epsilon and n
 	n0max = ceil(2. / eps);
 	n0max = 2;
 	// cout << "n0max = " << n0max << endl;
 	k = 1 + max(0.0, ceil(log(n0) / log(2-eps)));
+	assert(k <= kmax);
 
-	n = new int[k + 1]();
+	n = new size_t[k + 1]();
 	// cout << "k = " << k << endl;
 	n[k] = n0;
 	sentinel = newNode();
 	sentinel2 = newNode();
 	sentinel2->x = t_max;
 	Node *prev = sentinel;
-	for (int i = 0; i < n0; i++) {
+	for (size_t i = 0; i < n0; i++) {
 		Node *u = newNode();
 		u->x = data[i];
 		prev->next[k] = u;
@@ -134,20 +158,22 @@ template<class T>
 void TodoList2<T>::rebuild() {
 	// time to rebuild --- free everything and start over
 	// TODO: Put some padding in so we only do this O(loglog n) times
+	double start = counters.now();
 	T *data = new T[n[k]+1];
 	Node *prev = sentinel;
 	Node *u = sentinel->next[k];
-	for (int j = 0; j <= n[k]; j++) {
+	for (size_t j = 0; j <= n[k]; j++) {
 		data[j] = u->x;
 		deleteNode(prev);
 		prev = u;
 		u = u->next[k];
 	}
 	deleteNode(prev);
-	int enn = n[k];
+	size_t enn = n[k];
 	delete[] n;
 	init(data, enn);
 	delete[] data;
+	counters.rebuiltAll(start);
 }
 
 
@@ -155,10 +181,13 @@ template<class T>
 void TodoList2<T>::rebuild(int i) {
 
 	rebuild_freqs[i]++;
+	double start = counters.now();
+	size_t touched = 0;
 
 	for (int j = i - 1; j >= 0; j--) {
 		// populate L_j using L_{j+1}
-		n[j] = -1;  // start at -1 to make up for sentinel2
+		touched += n[j+1];
+		n[j] = 0;
 		Node *u = sentinel->next[j + 1];
 		Node *prev = sentinel;
 		bool skipped = false;
@@ -174,32 +203,82 @@ void TodoList2<T>::rebuild(int i) {
 			u = u->next[j + 1];
 		}
 		prev->next[j] = NULL;
+		n[j]--;  // make up for sentinel2
 	}
-
+	counters.rebuilt(i, touched, start);
 }
 
 template<class T>
 T TodoList2<T>::find(T x) {
+	counters.find();
+	// L_0 can have up to n0max elements, so it gets a full search
 	Node *u = sentinel;
-	for (int i = 0; i <= k; i++) {
-		if (u->next[i]->x < x)
+	while (precedes(u->next[0], x))
+		u = u->next[0];
+	for (int i = 1; i <= k; i++) {
+		if (precedes(u->next[i], x))
 			u = u->next[i];
 	}
 	Node *w = u->next[k];
 	return (w == sentinel2) ? (T)NULL : w->x;
 }
 
+/**
+ * Set out[j] = find(keys[j]) for j = 0,...,m-1, running g searches at once
+ * and prefetching the next node each of them will look at
+ */
+template<class T>
+void TodoList2<T>::findMany(const T *keys, T *out, size_t m, int g) {
+	Node *u[gmax];  // the search in slot s is at u[s]
+	int lev[gmax];  // about to look at L_{lev[s]}, or idle if lev[s] > k
+	size_t idx[gmax];  // and is looking for keys[idx[s]]
+	g = max(1, min(g, gmax));
+	for (int s = 0; s < g; s++)
+		lev[s] = k + 1;
+
+	size_t j = 0;
+	bool busy = true;
+	while (busy) {
+		busy = false;
+		for (int s = 0; s < g; s++) {
+			T x;
+			if (lev[s] > k) {
+				// slot s is idle, so start the next search in it
+				if (j == m) continue;
+				idx[s] = j++;
+				x = keys[idx[s]];
+				u[s] = sentinel;
+				while (u[s]->next[0]->x < x)
+					u[s] = u[s]->next[0];
+				lev[s] = 1;
+			} else {
+				x = keys[idx[s]];
+				if (u[s]->next[lev[s]]->x < x)
+					u[s] = u[s]->next[lev[s]];
+				lev[s]++;
+			}
+			busy = true;
+			if (lev[s] <= k) {
+				__builtin_prefetch(u[s]->next[lev[s]]);
+			} else {
+				Node *w = u[s]->next[k];
+				out[idx[s]] = (w == sentinel2) ? (T)NULL : w->x;
+			}
+		}
+	}
+}
+
 template<class T>
 bool TodoList2<T>::add(T x) {
+	counters.add();
 	// do a search for x and keep track of the search path
-	Node *path[50]; // FIXME: hard upper-bound
 	Node *u = sentinel;
 	int i = 0;
-	while (u->next[i] != NULL && u->next[i]->x < x)
+	while (u->next[i] != NULL && precedes(u->next[i], x))
 		u = u->next[i];
 	path[i] = u;
 	for (i = 1; i <= k; i++) {
-		if (u->next[i] != NULL && u->next[i]->x < x)
+		if (u->next[i] != NULL && precedes(u->next[i], x))
 			u = u->next[i];
 		path[i] = u;
 	}
@@ -235,6 +314,7 @@ template<class T>
 TodoList2<T>::~TodoList2() {
 	delete[] n;
 	delete[] a;
+	delete[] path;
 	delete[] rebuild_freqs;
 	Node *prev = sentinel;
 	while (prev != NULL) {
@@ -250,7 +330,7 @@ void TodoList2<T>::sanity() {
 	assert(n[0] <= n0max);
 	for (int i = 0; i <= k; i++) {
 		Node *u = sentinel;
-		for (int j = 0; j < n[i]; j++) {
+		for (size_t j = 0; j < n[i]; j++) {
 			assert(u == sentinel || u->x < u->next->x);
 			u = u->next[i];
 		}
@@ -258,15 +338,37 @@ void TodoList2<T>::sanity() {
 	}
 }
 
+template<class T>
+Stats TodoList2<T>::stats() {
+	Stats s;
+	s.structure = "TodoList2";
+	s.n = n[k];
+	s.k = k;
+	s.eps = eps;
+	s.bytesUsed = bytesUsed();
+	s.levels.resize(k + 1);
+	for (int i = 0; i <= k; i++) {
+		LevelStats &l = s.levels[i];
+		l.size = n[i];
+		l.maxSize = a[i];
+		l.bound = (i == 0) ? n0max : a[i];
+		l.rebuilds = rebuild_freqs[i];
+		l.touched = 0;
+		l.seconds = 0;
+	}
+	counters.fill(s);
+	return s;
+}
+
 template<class T>
 void TodoList2<T>::printOn(std::ostream &out) {
-	const int max_print = 50;
+	const size_t max_print = 50;
 	cout << "WSSkiplist: n = " << n[k] << ", k = " << k << endl;
 	for (int i = 0; i <= k; i++) {
 		cout << "L(" << i << "): ";
 		if (n[k] <= max_print) {
 			Node *u = sentinel->next[i];
-			for (int j = 0; j < n[i]; j++) {
+			for (size_t j = 0; j < n[i]; j++) {
 				cout << u->x << ",";
 				u = u->next[i];
 			}
@@ -0,0 +1,322 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * todolist3.h : A top-down skiplist for arithmetic keys with a branch-free,
+ *               unrolled find(x)
+ *
+ * This is TodoList2's idea without the hand-picked max0.  Keys are
+ * arithmetic, so every list ends at a tail node holding the largest T (or
+ * infinity) and find(x) never has to check for NULL.  That value can't be
+ * stored.  With the NULL check gone, each step of the search is
+ *
+ *     w = u->next[i];  u = (w->x < x) ? w : u;
+ *
+ * which compiles to a conditional move.  So the only branches left are the
+ * loop's, and there is a separate find for each value of k, with the loop
+ * fully unrolled, picked from a table whenever k changes.
+ *
+ * eps (in hundredths) and the largest number of lists, Kmax+1, are template
+ * parameters.  The default Kmax leaves room for 2^32 elements, and an add(x)
+ * (or a constructor) that would need more than Kmax+1 lists throws
+ * std::length_error and leaves the list as it was.
+ *
+ * - add(x) and remove(x) run in O(log n) amortized time.
+ * - find(x) runs in O(log n) worst-case time and performs
+ *   ceiling((1+epsilon)log n) comparisons, none of them followed by a branch.
+ */
+#ifndef FASTWS_TODOLIST3_H_
+#define FASTWS_TODOLIST3_H_
+
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+using namespace std;
+
+#include "arena.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+/**
+ * The number of times n has to be divided by base to get down to 1, which
+ * is the k that init() picks for n elements
+ */
+constexpr int todoLevels(double base, double n, int k = 0) {
+	return (n <= 1) ? k : todoLevels(base, n / base, k + 1);
+}
+
+template<class T, int Eps100 = 40,
+		int Kmax = todoLevels((200 - Eps100) / 100.0, 4294967296.0)>
+class TodoList3 {
+	static_assert(std::is_arithmetic<T>::value,
+			"TodoList3 needs arithmetic keys");
+	static_assert(0 < Eps100 && Eps100 < 100, "eps must be in (0,1)");
+
+protected:
+	struct Node {
+		T x;          // data
+		Node *next[]; // a stack of next pointers
+	};
+
+	typedef T (TodoList3::*FindFn)(T);
+
+	int k;    // there are k+1 lists numbered 0,...,k
+	size_t n[Kmax+1];  // n[i] is the size of the i'th list
+	size_t a[Kmax+1];  // the largest n[i] can get before a rebuild
+	Node *sentinel; // sentinel->next[i] is the first element of list i
+	Node *tail;     // every list ends here, and tail->x is bigger than any key
+	Arena arena;    // where all the nodes come from
+	FindFn findFn;  // findK<k>
+
+	// scratch space for recording search paths
+	Node *path[Kmax+1];
+
+	static const size_t n0max = 1;
+
+	static T infinity() {
+		return numeric_limits<T>::has_infinity ? numeric_limits<T>::infinity()
+				: numeric_limits<T>::max();
+	}
+
+	// the k that init() picks for n0 elements, if that is at most Kmax
+	static int levels(size_t n0) {
+		int k = todoLevels((200 - Eps100) / 100.0, n0);
+		if (k > Kmax)
+			throw std::length_error("TodoList3: more than Kmax+1 lists");
+		return k;
+	}
+	void init(T *data, size_t n0);
+	void rebuild();
+	void rebuild(int i);
+	Node *newNode();
+
+	template<int K> T findK(T x);
+	template<int... K>
+	static const FindFn *findTable(std::integer_sequence<int, K...>) {
+		static const FindFn table[] = { &TodoList3::template findK<K>... };
+		return table;
+	}
+
+public:
+	TodoList3(T *data = NULL, size_t n0 = 0);
+	virtual ~TodoList3() { }
+	T find(T x) {
+		return (this->*findFn)(x);
+	}
+	bool add(T x);
+	bool remove(T x);
+	size_t size() {
+		return n[k];
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class T, int Eps100, int Kmax>
+TodoList3<T,Eps100,Kmax>::TodoList3(T *data, size_t n0)
+		: arena(sizeof(Node)) {
+	setThresholds(a, Kmax, Eps100 / 100.0);
+	init(data, n0);
+}
+
+template<class T, int Eps100, int Kmax>
+void TodoList3<T,Eps100,Kmax>::init(T *data, size_t n0) {
+	k = levels(n0);
+	fill(n, n + k + 1, 0);
+	n[k] = n0;
+	findFn = findTable(std::make_integer_sequence<int, Kmax+1>())[k];
+
+	arena.reset(sizeof(Node) + (k + 1) * sizeof(Node*));
+	tail = NULL;
+	tail = newNode();
+	tail->x = infinity();
+	sentinel = newNode();
+	Node *prev = sentinel;
+	for (size_t i = 0; i < n0; i++) {
+		Node *u = newNode();
+		u->x = data[i];
+		prev->next[k] = u;
+		prev = u;
+	}
+	prev->next[k] = tail;
+	arena.trim();
+	rebuild(k);
+}
+
+template<class T, int Eps100, int Kmax>
+typename TodoList3<T,Eps100,Kmax>::Node* TodoList3<T,Eps100,Kmax>::newNode() {
+	Node *u = (Node *) arena.alloc();
+	for (int i = 0; i <= k; i++)
+		u->next[i] = tail;
+	return u;
+}
+
+template<class T, int Eps100, int Kmax>
+void TodoList3<T,Eps100,Kmax>::rebuild() {
+	T *data = new T[n[k]];
+	Node *u = sentinel->next[k];
+	for (size_t j = 0; j < n[k]; j++) {
+		data[j] = u->x;
+		u = u->next[k];
+	}
+	init(data, n[k]);
+	delete[] data;
+}
+
+template<class T, int Eps100, int Kmax>
+void TodoList3<T,Eps100,Kmax>::rebuild(int i) {
+	for (int j = i - 1; j >= 0; j--) {
+		// populate L_j using L_{j+1}
+		n[j] = 0;
+		Node *prev = sentinel;
+		bool skipped = false;
+		for (Node *u = sentinel->next[j + 1]; u != tail; u = u->next[j + 1]) {
+			if (skipped) {
+				prev->next[j] = u;
+				prev = u;
+				n[j]++;
+			}
+			skipped = !skipped;
+		}
+		prev->next[j] = tail;
+	}
+}
+
+/**
+ * find(x) for a list with exactly K+1 levels
+ */
+template<class T, int Eps100, int Kmax> template<int K>
+T TodoList3<T,Eps100,Kmax>::findK(T x) {
+	Node *u = sentinel;
+#pragma GCC unroll 128
+	for (int i = 0; i <= K; i++) {
+		Node *w = u->next[i];
+		u = (w->x < x) ? w : u;
+	}
+	Node *w = u->next[K];
+	return (w == tail) ? (T)NULL : w->x;
+}
+
+template<class T, int Eps100, int Kmax>
+bool TodoList3<T,Eps100,Kmax>::add(T x) {
+	assert(x < tail->x);
+
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (u->next[i]->x < x)
+			u = u->next[i];
+		path[i] = u;
+	}
+
+	// check if x is already here and, if so, abort
+	Node *w = u->next[k];
+	if (w->x == x)
+		return false;
+
+	// make sure the rebuild that x may cause has enough lists
+	if (n[k] >= a[k])
+		levels(n[k] + 1);
+
+	// insert x everywhere along the search path
+	w = newNode();
+	w->x = x;
+	for (i = k; i >= 0; i--) {
+		w->next[i] = path[i]->next[i];
+		path[i]->next[i] = w;
+		n[i]++;
+	}
+
+	// check if we need to add another level on the bottom
+	if (n[k] > a[k])
+		rebuild();
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T, int Eps100, int Kmax>
+bool TodoList3<T,Eps100,Kmax>::remove(T x) {
+	// do a search for x and keep track of the search path
+	Node *u = sentinel;
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (u->next[i]->x < x)
+			u = u->next[i];
+		path[i] = u;
+	}
+
+	// check if x is here and, if not, abort
+	Node *w = u->next[k];
+	if (w == tail || !(w->x == x))
+		return false;
+
+	// unlink w from every list it appears in
+	for (i = 0; i <= k; i++) {
+		if (path[i]->next[i] == w) {
+			path[i]->next[i] = w->next[i];
+			n[i]--;
+		}
+	}
+	arena.free(w);
+
+	// promote the second element of any L_i gap that got too big, as in
+	// TodoList::remove()
+	for (i = k - 1; i >= 0; i--) {
+		Node *end = path[i]->next[i];
+		Node *v = path[i]->next[i+1];
+		if (v == end || v->next[i+1] == end)
+			continue;
+		v = v->next[i+1];
+		v->next[i] = end;
+		path[i]->next[i] = v;
+		n[i]++;
+	}
+
+	// check if we need to remove a level from the bottom
+	if (k > 1 && n[k] < a[k-2]) {
+		rebuild();
+		return true;
+	}
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class T, int Eps100, int Kmax>
+void TodoList3<T,Eps100,Kmax>::printOn(std::ostream &out) {
+	out << "TodoList3: n = " << n[k] << ", k = " << k << endl;
+	for (int i = 0; i <= k; i++)
+		out << " n(" << i << ") = " << n[i] << endl;
+}
+
+template<class T, int Eps100, int Kmax>
+ostream& operator<<(ostream &out, TodoList3<T,Eps100,Kmax> &sl) {
+	sl.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_TODOLIST3_H_
@@ -0,0 +1,459 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * todomap.h : A top-down skiplist that maps keys to values
+ *
+ * TodoMap<K,V,Compare> is TodoList with a value stored next to each key and
+ * the key order given by a comparator object instead of operator<.  The
+ * comparator is a template parameter, so every call to it can be inlined,
+ * and it is a three-way comparison (negative, zero or positive, like
+ * strcmp()), so a search knows it has found its key as soon as it sees it
+ * on any list, without a second comparison for equality.
+ *
+ * Lookups take their key by const reference and hand back a pointer to the
+ * value stored in the node, so nothing gets copied on the lookup path.
+ * Pointers to values stay good until the key is removed or a global
+ * rebuild moves the nodes (any insertOrAssign() or emplace() can do that).
+ *
+ * - get(x) and find(x) run in O(log n) time and do about
+ *   (1+epsilon)log n comparisons.
+ * - insertOrAssign(), emplace() and remove() run in O(log n) amortized time.
+ */
+#ifndef FASTWS_TODOMAP_H_
+#define FASTWS_TODOMAP_H_
+
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <cassert>
+
+#include <iostream>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <utility>
+using namespace std;
+
+#include "arena.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+/**
+ * The default comparator for TodoMap: a three-way comparison made from <,
+ * or from compare() for strings, which gets it in one pass over the bytes
+ */
+template<class K>
+struct Compare3 {
+	int operator()(const K &a, const K &b) const {
+		return (b < a) - (a < b);
+	}
+};
+
+template<>
+struct Compare3<std::string> {
+	int operator()(const std::string &a, const std::string &b) const {
+		return a.compare(b);
+	}
+};
+
+template<class K, class V, class Compare = Compare3<K> >
+class TodoMap {
+protected:
+	struct Node {
+		K key;
+		V value;
+		Node *next[]; // a stack of next pointers
+	};
+
+	int k;    // there are k+1 lists numbered 0,...,k
+	int kmax; // k never gets bigger than this
+	size_t *n;   // n[i] is the size of the i'th list
+	Node *sentinel; // sentinel-next[i] is the first element of list i
+	Arena *arena;   // where all the nodes come from
+	Compare comp;
+
+	// parameters used to determine lists sizes
+	double eps;
+	size_t n0max;
+	size_t *a;
+
+	// scratch space for recording search paths
+	Node **path;
+
+	void init(size_t n0);
+	Node *rebuild(Node *w);
+	void rebuild(int i);
+
+	Node *newNode();
+	void deleteNode(Node *u);
+	Node *findPredNode(const K &x);
+	Node *search(const K &x);
+	Node *insert(Node *w);
+
+public:
+	/**
+	 * A forward iterator over the entries in key order (that is, along L_k).
+	 * Any insertOrAssign(), emplace() or remove() invalidates it.
+	 */
+	class Iterator {
+	protected:
+		friend class TodoMap<K,V,Compare>;
+		Node *u;
+		int k;
+		Iterator(Node *u0, int k0) : u(u0), k(k0) { }
+	public:
+		Iterator() : u(NULL), k(0) { }
+		const K& key() { return u->key; }
+		V& value() { return u->value; }
+		Iterator& operator++() {
+			u = u->next[k];
+			if (u != NULL)
+				__builtin_prefetch(u->next[k]);
+			return *this;
+		}
+		bool operator==(const Iterator &it) const { return u == it.u; }
+		bool operator!=(const Iterator &it) const { return u != it.u; }
+	};
+
+	TodoMap(double eps0 = .4, const Compare &comp0 = Compare());
+	virtual ~TodoMap();
+	V* get(const K &x);
+	V* find(const K &x, const K **key = NULL);
+	Iterator begin() {
+		return Iterator(sentinel->next[k], k);
+	}
+	Iterator end() {
+		return Iterator(NULL, k);
+	}
+	Iterator lowerBound(const K &x) {
+		return Iterator(findPredNode(x)->next[k], k);
+	}
+	template<class W> bool insertOrAssign(const K &x, W &&v);
+	template<class... Args> pair<V*,bool> emplace(const K &x, Args&&... args);
+	bool remove(const K &x);
+	size_t size() {
+		return n[k];
+	}
+	size_t bytesUsed() {
+		return arena->bytesReserved() + sizeof(*this) + (k+1)*sizeof(size_t)
+				+ (kmax+1)*(sizeof(size_t) + sizeof(Node*));
+	}
+
+	void printOn(std::ostream &out);
+};
+
+template<class K, class V, class Compare>
+TodoMap<K,V,Compare>::TodoMap(double eps0, const Compare &comp0)
+		: comp(comp0) {
+	eps = eps0;
+
+	kmax = maxLevel(eps);
+	path = new Node*[kmax+1];
+	a = new size_t[kmax+1];
+	setThresholds(a, kmax, eps);
+	n = NULL;
+	arena = NULL;
+	init(0);
+}
+
+/**
+ * Start over with room for n0 elements: a new arena, an empty sentinel and
+ * the sizes of the lists set for n0 elements that haven't been linked yet
+ */
+template<class K, class V, class Compare>
+void TodoMap<K,V,Compare>::init(size_t n0) {
+	n0max = 1;
+	k = max(0.0, ceil(log(n0) / log(2-eps)));
+	assert(k <= kmax);
+	delete[] n;
+	n = new size_t[k + 1]();
+	n[k] = n0;
+	arena = new Arena(sizeof(Node) + (k + 1) * sizeof(Node*));
+	sentinel = newNode();
+}
+
+template<class K, class V, class Compare>
+typename TodoMap<K,V,Compare>::Node* TodoMap<K,V,Compare>::newNode() {
+	Node *u = (Node *) arena->alloc();
+	memset(u->next, '\0', (k + 1) * sizeof(Node*));
+	return u;
+}
+
+template<class K, class V, class Compare>
+void TodoMap<K,V,Compare>::deleteNode(Node *u) {
+	u->key.~K();
+	u->value.~V();
+	arena->free(u);
+}
+
+/**
+ * Move everything into nodes with room for the new number of lists, and
+ * return the new home of w
+ */
+template<class K, class V, class Compare>
+typename TodoMap<K,V,Compare>::Node* TodoMap<K,V,Compare>::rebuild(Node *w) {
+	Node *u = sentinel->next[k];
+	int k0 = k;
+	Arena *old = arena;
+	init(n[k]);
+	Node *prev = sentinel, *w2 = NULL;
+	while (u != NULL) {
+		Node *v = newNode();
+		new (&v->key) K(std::move(u->key));
+		new (&v->value) V(std::move(u->value));
+		if (u == w) w2 = v;
+		prev->next[k] = v;
+		prev = v;
+		Node *next = u->next[k0];
+		u->key.~K();
+		u->value.~V();
+		u = next;
+	}
+	delete old;
+	rebuild(k);
+	return w2;
+}
+
+template<class K, class V, class Compare>
+void TodoMap<K,V,Compare>::rebuild(int i) {
+	for (int j = i - 1; j >= 0; j--) {
+		// populate L_j using L_{j+1}
+		n[j] = 0;
+		Node *u = sentinel->next[j + 1];
+		Node *prev = sentinel;
+		bool skipped = false;
+		while (u != NULL) {
+			if (skipped) {
+				prev->next[j] = u;
+				prev = u;
+				n[j]++;
+				skipped = false;
+			} else {
+				skipped = true;
+			}
+			u = u->next[j + 1];
+		}
+		prev->next[j] = NULL;
+	}
+}
+
+/**
+ * Return the last node of L_k whose key is less than x, which may be sentinel
+ */
+template<class K, class V, class Compare>
+typename TodoMap<K,V,Compare>::Node* TodoMap<K,V,Compare>::findPredNode(
+		const K &x) {
+	Node *u = sentinel;
+	for (int i = 0; i <= k; i++) {
+		if (u->next[i] != NULL && comp(u->next[i]->key, x) < 0)
+			u = u->next[i];
+	}
+	return u;
+}
+
+/**
+ * Return the value stored under x, or NULL if x isn't here.  This stops on
+ * the first list that contains x.
+ */
+template<class K, class V, class Compare>
+V* TodoMap<K,V,Compare>::get(const K &x) {
+	Node *u = sentinel, *bigger = NULL;  // bigger is known to be > x
+	for (int i = 0; i <= k; i++) {
+		Node *w = u->next[i];
+		if (w != NULL && w != bigger) {
+			int c = comp(w->key, x);
+			if (c == 0)
+				return &w->value;
+			if (c < 0)
+				u = w;
+			else
+				bigger = w;
+		}
+	}
+	// if we moved along L_k then we haven't looked at u->next[k] yet
+	Node *w = u->next[k];
+	if (w != NULL && w != bigger && comp(w->key, x) == 0)
+		return &w->value;
+	return NULL;
+}
+
+/**
+ * Return the value stored under the smallest key >= x, or NULL if there
+ * isn't one.  If key is not NULL then *key is set to point at that key.
+ */
+template<class K, class V, class Compare>
+V* TodoMap<K,V,Compare>::find(const K &x, const K **key) {
+	Node *w = findPredNode(x)->next[k];
+	if (w == NULL)
+		return NULL;
+	if (key != NULL)
+		*key = &w->key;
+	return &w->value;
+}
+
+/**
+ * Record the search path for x in path[] and return the node containing x,
+ * or NULL if x isn't here
+ */
+template<class K, class V, class Compare>
+typename TodoMap<K,V,Compare>::Node* TodoMap<K,V,Compare>::search(
+		const K &x) {
+	Node *u = sentinel, *bigger = NULL, *found = NULL;
+	for (int i = 0; i <= k; i++) {
+		Node *w = u->next[i];
+		if (w != NULL && w != bigger && w != found) {
+			int c = comp(w->key, x);
+			if (c < 0)
+				u = w;
+			else if (c == 0)
+				found = w;
+			else
+				bigger = w;
+		}
+		path[i] = u;
+	}
+	Node *w = u->next[k];
+	if (found == NULL && w != NULL && w != bigger && comp(w->key, x) == 0)
+		found = w;
+	return found;
+}
+
+/**
+ * Insert w along the search path recorded by search(), rebalance and return
+ * w's (possibly new) location
+ */
+template<class K, class V, class Compare>
+typename TodoMap<K,V,Compare>::Node* TodoMap<K,V,Compare>::insert(Node *w) {
+	int i;
+	for (i = k; i >= 0; i--) {
+		w->next[i] = path[i]->next[i];
+		path[i]->next[i] = w;
+		n[i]++;
+	}
+
+	// check if we need to add another level on the bottom
+	if (n[k] > a[k])
+		return rebuild(w);
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return w;
+}
+
+/**
+ * Store v under x, replacing any value already there, and return true if x
+ * is new
+ */
+template<class K, class V, class Compare> template<class W>
+bool TodoMap<K,V,Compare>::insertOrAssign(const K &x, W &&v) {
+	Node *w = search(x);
+	if (w != NULL) {
+		w->value = std::forward<W>(v);
+		return false;
+	}
+	w = newNode();
+	new (&w->key) K(x);
+	new (&w->value) V(std::forward<W>(v));
+	insert(w);
+	return true;
+}
+
+/**
+ * If x isn't here, add it with a value constructed in place from args.
+ * Either way, return a pointer to the value stored under x and whether x
+ * is new.
+ */
+template<class K, class V, class Compare> template<class... Args>
+pair<V*,bool> TodoMap<K,V,Compare>::emplace(const K &x, Args&&... args) {
+	Node *w = search(x);
+	if (w != NULL)
+		return make_pair(&w->value, false);
+	w = newNode();
+	new (&w->key) K(x);
+	new (&w->value) V(std::forward<Args>(args)...);
+	w = insert(w);
+	return make_pair(&w->value, true);
+}
+
+template<class K, class V, class Compare>
+bool TodoMap<K,V,Compare>::remove(const K &x) {
+	// do a search for x and keep track of the search path
+	Node *w = search(x);
+	if (w == NULL)
+		return false;
+
+	// unlink w from every list it appears in
+	int i;
+	for (i = 0; i <= k; i++) {
+		if (path[i]->next[i] == w) {
+			path[i]->next[i] = w->next[i];
+			n[i]--;
+		}
+	}
+	deleteNode(w);
+
+	// promote the second element of any L_i gap that got too big, as in
+	// TodoList::remove()
+	for (i = k - 1; i >= 0; i--) {
+		Node *end = path[i]->next[i];
+		Node *v = path[i]->next[i+1];
+		if (v == end || v->next[i+1] == end)
+			continue;
+		v = v->next[i+1];
+		v->next[i] = end;
+		path[i]->next[i] = v;
+		n[i]++;
+	}
+
+	// check if we need to remove a level from the bottom
+	if (k > 1 && n[k] < a[k-2]) {
+		rebuild((Node*)NULL);
+		return true;
+	}
+
+	// do partial rebuilding, if necessary
+	if (n[0] > n0max) {
+		for (i = 1; n[i] > a[i]; i++);
+		assert(i <= k);
+		rebuild(i);
+	}
+	return true;
+}
+
+template<class K, class V, class Compare>
+TodoMap<K,V,Compare>::~TodoMap() {
+	for (Node *u = sentinel->next[k]; u != NULL;) {
+		Node *next = u->next[k];
+		u->key.~K();
+		u->value.~V();
+		u = next;
+	}
+	delete arena;
+	delete[] n;
+	delete[] a;
+	delete[] path;
+}
+
+template<class K, class V, class Compare>
+void TodoMap<K,V,Compare>::printOn(std::ostream &out) {
+	out << "TodoMap: n = " << n[k] << ", k = " << k << endl;
+	for (int i = 0; i <= k; i++)
+		out << " n(" << i << ") = " << n[i] << endl;
+}
+
+template<class K, class V, class Compare>
+ostream& operator<<(ostream &out, TodoMap<K,V,Compare> &m) {
+	m.printOn(out);
+	return out;
+}
+
+} // fastws namespace
+
+#endif // FASTWS_TODOMAP_H_
@@ -0,0 +1,334 @@
+/**
+ * (c) 2014 Pat Morin, Released under a CC BY 3.0 License:
+ *     https://creativecommons.org/licenses/by/3.0/
+ *
+ * todosnapshot.h : TodoList snapshots that are searched straight from a
+ *                  memory-mapped file
+ *
+ * TodoSnapshot<T>::save(l, path) writes TodoList l to a file without any
+ * pointers in it.  L_k is written as the sorted array of keys and each
+ * L_i, i < k, as an array of (key, down) pairs, where down is the index in
+ * L_{i+1} of the same element.  The search that TodoList does by following
+ * u->next[i] becomes a walk through these arrays: if the search is at
+ * index j of L_i, then u->next[i] is entry j+1 and the search continues on
+ * L_{i+1} from entry down.  The header records k, eps and n[0..k], and the
+ * byte offset of each list, so the file can be mapped anywhere.
+ *
+ * Opening a snapshot just maps the file read-only, so find(x) runs on the
+ * mapped pages with no deserialization and pages come in as they are
+ * touched.  With shm = true the path is a POSIX shared memory name
+ * (shm_open), and every worker process that opens it shares one read-only
+ * copy of the pages.
+ *
+ * The snapshot itself is never written.  The first add(x) or remove(x)
+ * copies the keys into an ordinary TodoList (one pass, with no searches,
+ * like a global rebuild) and from then on everything goes to that copy.
+ *
+ * T has to be trivially copyable, and the file can only be read on a
+ * machine with the same sizeof(T) and byte order.
+ */
+#ifndef FASTWS_TODOSNAPSHOT_H_
+#define FASTWS_TODOSNAPSHOT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "todolist.h"
+#include "thresholds.h"
+
+namespace fastws {
+
+template<class T>
+class TodoSnapshot {
+	static_assert(std::is_trivially_copyable<T>::value,
+			"TodoSnapshot needs trivially copyable keys");
+
+protected:
+	typedef typename TodoList<T>::Node Node;
+
+	struct Header {
+		char magic[8];     // "TODOSNAP"
+		uint32_t version;
+		uint32_t keySize;  // sizeof(T)
+		int32_t k;
+		double eps;
+		uint64_t bytes;    // the size of the whole file
+		// followed by uint64_t n[k+1] and uint64_t offset[k+1]
+	};
+
+	// an element of L_i, i < k
+	struct Entry {
+		T x;
+		uint64_t down;  // its index in L_{i+1}
+	};
+
+	static const uint32_t version = 1;
+
+	char *base;      // the mapped file, or NULL if it couldn't be opened
+	size_t bytes;
+	int k;
+	double eps;
+	const uint64_t *n;  // n[i] is the size of L_i
+	const uint64_t *offset;  // L_i starts at base + offset[i]
+
+	TodoList<T> *l;  // our writable copy, once there is one
+
+	static int openFile(const char *path, int flags, bool shm);
+	static size_t layout(int k, const size_t *n, uint64_t *offset);
+	static bool valid(const Header *h, size_t bytes);
+	const Entry *level(int i) {
+		return (const Entry*)(base + offset[i]);
+	}
+	const T *keys() {
+		return (const T*)(base + offset[k]);
+	}
+	void thaw();
+
+public:
+	static bool save(TodoList<T> &l, const char *path, bool shm = false);
+	static bool unlink(const char *path, bool shm = false);
+
+	TodoSnapshot(const char *path, bool shm = false);
+	virtual ~TodoSnapshot();
+	bool isOpen() {
+		return base != NULL;
+	}
+	T find(T x);
+	bool add(T x);
+	bool remove(T x);
+	size_t size() {
+		return (l != NULL) ? l->size() : n[k];
+	}
+	// the writable copy, made now if we don't have one yet
+	TodoList<T> *todoList() {
+		thaw();
+		return l;
+	}
+};
+
+template<class T>
+int TodoSnapshot<T>::openFile(const char *path, int flags, bool shm) {
+	if (shm)
+		return shm_open(path, flags, 0644);
+	return open(path, flags, 0644);
+}
+
+/**
+ * Fill in offset[0..k] for lists of sizes n[0..k] and return the size of
+ * the file.  Each list starts on a cache line.
+ */
+template<class T>
+size_t TodoSnapshot<T>::layout(int k, const size_t *n, uint64_t *offset) {
+	const size_t line = 64;
+	size_t at = sizeof(Header) + 2*(k+1)*sizeof(uint64_t);
+	for (int i = 0; i <= k; i++) {
+		at = (at + line - 1) / line * line;
+		offset[i] = at;
+		at += n[i] * ((i < k) ? sizeof(Entry) : sizeof(T));
+	}
+	return at;
+}
+
+/**
+ * Write l to path (or to the shared memory object path, if shm is set) and
+ * return true if that worked.  l may be in the middle of an incremental job,
+ * so only its elements are read, in order, and the levels written are the
+ * ones a global rebuild would give them: element t of L_k is in L_{k-d} for
+ * every d such that 2^d divides t+1, so entry j of L_i is entry 2j+1 of
+ * L_{i+1}.
+ */
+template<class T>
+bool TodoSnapshot<T>::save(TodoList<T> &l, const char *path, bool shm) {
+	size_t m = l.size();
+	int k = l.levels(m);
+	size_t *ns = new size_t[k+1];
+	for (int d = 0; d <= k; d++)
+		ns[k-d] = (d < 64) ? m >> d : 0;
+	uint64_t *offset = new uint64_t[k+1];
+	size_t bytes = layout(k, ns, offset);
+
+	int fd = openFile(path, O_RDWR | O_CREAT | O_TRUNC, shm);
+	if (fd < 0) {
+		delete[] ns;
+		delete[] offset;
+		return false;
+	}
+	char *p = NULL;
+	if (ftruncate(fd, bytes) == 0) {
+		p = (char*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			p = NULL;
+	}
+	close(fd);
+	if (p == NULL) {
+		delete[] ns;
+		delete[] offset;
+		return false;
+	}
+
+	Header *h = (Header*)p;
+	memcpy(h->magic, "TODOSNAP", 8);
+	h->version = version;
+	h->keySize = sizeof(T);
+	h->k = k;
+	h->eps = l.eps;
+	h->bytes = bytes;
+	uint64_t *hn = (uint64_t*)(h + 1);
+	for (int i = 0; i <= k; i++) {
+		hn[i] = ns[i];
+		hn[k+1+i] = offset[i];
+	}
+
+	T *xs = (T*)(p + offset[k]);
+	size_t t = 0;
+	for (Node *u = l.first(); u != NULL; u = l.after(u))
+		xs[t++] = u->x;
+	assert(t == m);
+	for (int i = 0; i < k; i++) {
+		Entry *e = (Entry*)(p + offset[i]);
+		int d = k - i;
+		for (size_t j = 0; j < ns[i]; j++) {
+			e[j].x = xs[((j + 1) << d) - 1];
+			e[j].down = 2*j + 1;
+		}
+	}
+
+	bool ok = msync(p, bytes, MS_SYNC) == 0;
+	munmap(p, bytes);
+	delete[] ns;
+	delete[] offset;
+	return ok;
+}
+
+template<class T>
+bool TodoSnapshot<T>::unlink(const char *path, bool shm) {
+	return (shm ? shm_unlink(path) : ::unlink(path)) == 0;
+}
+
+/**
+ * Map the snapshot in path (or in the shared memory object path)
+ */
+template<class T>
+TodoSnapshot<T>::TodoSnapshot(const char *path, bool shm) {
+	base = NULL;
+	l = NULL;
+	int fd = openFile(path, O_RDONLY, shm);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+		bytes = st.st_size;
+		void *p = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED)
+			base = (char*)p;
+	}
+	close(fd);
+	if (base == NULL)
+		return;
+
+	const Header *h = (const Header*)base;
+	if (memcmp(h->magic, "TODOSNAP", 8) != 0 || h->version != version
+			|| h->keySize != sizeof(T) || h->bytes != bytes
+			|| !valid(h, bytes)) {
+		munmap(base, bytes);
+		base = NULL;
+		return;
+	}
+	k = h->k;
+	eps = h->eps;
+	n = (const uint64_t*)(h + 1);
+	offset = n + k + 1;
+}
+
+/**
+ * Check that the lists described by the header of a file of the given size
+ * are inside the file, so a truncated or corrupt file is never searched
+ */
+template<class T>
+bool TodoSnapshot<T>::valid(const Header *h, size_t bytes) {
+	if (!(h->eps > 0 && h->eps < 1) || h->k < 0 || h->k > maxLevel(h->eps))
+		return false;
+	int k = h->k;
+	if (sizeof(Header) + 2*(k+1)*sizeof(uint64_t) > bytes)
+		return false;
+	const uint64_t *n = (const uint64_t*)(h + 1);
+	const uint64_t *offset = n + k + 1;
+	for (int i = 0; i <= k; i++) {
+		size_t w = (i < k) ? sizeof(Entry) : sizeof(T);
+		if (offset[i] > bytes || n[i] > (bytes - offset[i]) / w)
+			return false;
+		if (i < k && n[i+1] < n[i])
+			return false;
+	}
+	return true;
+}
+
+template<class T>
+TodoSnapshot<T>::~TodoSnapshot() {
+	delete l;
+	if (base != NULL)
+		munmap(base, bytes);
+}
+
+/**
+ * The same search as TodoList::find(x), with array indices for pointers
+ */
+template<class T>
+T TodoSnapshot<T>::find(T x) {
+	if (l != NULL)
+		return l->find(x);
+	int64_t j = -1;  // the search is at entry j of L_i (-1 is the sentinel)
+	for (int i = 0; i < k; i++) {
+		const Entry *e = level(i);
+		if ((uint64_t)(j + 1) < n[i]) {
+			// whichever way this goes, the next comparison is with the entry
+			// after e[j].down or e[j+1].down, so get both of them coming
+			const char *next = base + offset[i+1];
+			size_t w = (i + 1 < k) ? sizeof(Entry) : sizeof(T);
+			if (j >= 0)
+				__builtin_prefetch(next + (e[j].down + 1) * w);
+			__builtin_prefetch(next + (e[j+1].down + 1) * w);
+			if (e[j+1].x < x)
+				j++;
+		}
+		// a down index past the end of L_{i+1} can only come from a corrupt
+		// file, and is kept inside the mapping
+		j = (j < 0) ? -1 : (int64_t)std::min(e[j].down, n[i+1] - 1);
+	}
+	const T *xs = keys();
+	if ((uint64_t)(j + 1) < n[k] && xs[j+1] < x)
+		j++;
+	return ((uint64_t)(j + 1) < n[k]) ? xs[j+1] : (T)NULL;
+}
+
+/**
+ * Copy the keys into a TodoList that we can change
+ */
+template<class T>
+void TodoSnapshot<T>::thaw() {
+	if (l == NULL)
+		l = new TodoList<T>(const_cast<T*>(keys()), n[k], eps);
+}
+
+template<class T>
+bool TodoSnapshot<T>::add(T x) {
+	thaw();
+	return l->add(x);
+}
+
+template<class T>
+bool TodoSnapshot<T>::remove(T x) {
+	thaw();
+	return l->remove(x);
+}
+
+} // fastws namespace
+
+#endif // FASTWS_TODOSNAPSHOT_H_
@@ -8,6 +8,12 @@
  * structure has its own array of length k=Theta(log n)$ that is used to
  * store its previous and next pointers.  This avoids the allocating and
  * freeing of nodes when nodes are promoted or levels are rebuilt.
+ *
+ * With Inline set, each entry of that array also holds a copy of the key
+ * of the node it points at.  Then a search step reads one entry of u's
+ * tower and nothing else, instead of the entry and the start of the next
+ * node, which is usually another cache miss.  The towers get twice as big
+ * (for small keys).
  */
 #ifndef FASTWS_WSSKIPLIST_H_
 #define FASTWS_WSSKIPLIST_H_
@@ -17,16 +23,31 @@
 #include <cstdlib>
 #include <climits>
 #include <cassert>
+#include <type_traits>
+
+#include "arena.h"
+#include "stats.h"
 
 namespace fastws {
 
 /**
  * A dictionary with the working-set property.
  */
-template<class T>
+template<class T, bool Inline = false>
 class WSSkiplist {
 protected:
 	struct NP;
+	struct Node;
+
+	// a tower entry, with or without a copy of node->x
+	struct Slot {
+		Node *node;
+	};
+	struct KeySlot {
+		Node *node;
+		T x;
+	};
+	typedef typename std::conditional<Inline, KeySlot, Slot>::type Link;
 
 	struct Node {
 		int w; // the working-set number (not always correct)
@@ -36,12 +57,13 @@ protected:
 		Node *qnext;
 		Node *qprev;
 
-		Node *next[]; // a stack of next pointers
+		Link next[]; // a stack of next pointers
 	};
 
 	int k;    // there are k+1 lists numbered 0,...,k
 	int *n;   // n[i] is the size of the i'th list
 	Node *sentinel; // sentinel-next[i] is the first element of list i
+	Arena arena;    // where all the nodes come from
 
 	// parameters used to determine lists sizes
 	double eps;
@@ -49,8 +71,9 @@ protected:
 	int *a;
 	int *b;
 
-	// FIXME: for profiling information
+	// rebuild_freqs[i] is the number of calls to rebuild(i), for stats()
 	int *rebuild_freqs;
+	StatCounters counters;
 
 	void init(T *data, int n);
 	void rebuild(int i);
@@ -63,28 +86,58 @@ protected:
 	// FIXME: integer only
 	int (*cmp)(const T &a, const T &b);
 
+	// the key of the node l points at, which isn't NULL
+	const T& key(const Slot &l) {
+		counters.touch(&l.node->x);
+		return l.node->x;
+	}
+	const T& key(const KeySlot &l) {
+		return l.x;
+	}
+	static void link(Slot &l, Node *v) {
+		l.node = v;
+	}
+	static void link(KeySlot &l, Node *v) {
+		l.node = v;
+		if (v != NULL)
+			l.x = v->x;
+	}
+
 public:
 	WSSkiplist(T *data, int n0, int (*cmp0)(const T&, const T&),
-			double eps0);
+			double eps0, bool hugepages = false);
 	virtual ~WSSkiplist();
 	T find(T x);
 	int size() {
 		return n[k];
 	}
+	size_t bytesUsed() {
+		return arena.bytesReserved() + sizeof(*this) + 4*(k+1)*sizeof(int);
+	}
+	size_t nodeAllocations() {
+		return arena.blockAllocations();
+	}
+	size_t systemAllocations() {
+		return arena.systemAllocations();
+	}
+	Stats stats();
+	void resetStats() {
+		counters.reset();
+	}
 
 	void printOn(std::ostream &out);
 };
 
-template<class T>
-WSSkiplist<T>::WSSkiplist(T *data, int n0, int (*cmp0)(const T&, const T&),
-	double eps0) {
+template<class T, bool Inline>
+WSSkiplist<T,Inline>::WSSkiplist(T *data, int n0, int (*cmp0)(const T&, const T&),
+	double eps0, bool hugepages) : arena(sizeof(Node), hugepages) {
 	eps = eps0;
 	cmp = cmp0;
 	init(data, n0);
 }
 
-template<class T>
-void WSSkiplist<T>::init(T *data, int n0) {
+template<class T, bool Inline>
+void WSSkiplist<T,Inline>::init(T *data, int n0) {
 
 	// Compute critical values depending on epsilon
 	n0max = ceil(2. / eps);
@@ -108,6 +161,7 @@ void WSSkiplist<T>::init(T *data, int n0) {
 	n = new int[k + 1]();
 
 	n[k] = n0;
+	arena.reset(sizeof(Node) + (k + 1) * sizeof(Link));
 	sentinel = newNode();
 	sentinel->x = -1; // FIXME: non-negative integer only
 	sentinel->qnext = sentinel->qprev = sentinel;
@@ -115,7 +169,7 @@ void WSSkiplist<T>::init(T *data, int n0) {
 	for (int i = 0; i < n0; i++) {
 		Node *u = newNode();
 		u->x = data[i];
-		prev->next[k] = u;
+		link(prev->next[k], u);
 		u->qprev = prev;
 		prev->qnext = u;
 		prev = u;
@@ -124,24 +178,26 @@ void WSSkiplist<T>::init(T *data, int n0) {
 	rebuild(k);
 }
 
-template<class T>
-typename WSSkiplist<T>::Node* WSSkiplist<T>::newNode() {
-	Node *u = (Node *) malloc(sizeof(Node) + (k + 1) * sizeof(Node*));
+template<class T, bool Inline>
+typename WSSkiplist<T,Inline>::Node* WSSkiplist<T,Inline>::newNode() {
+	Node *u = (Node *) arena.alloc();
 	u->qnext = u->qprev = NULL;
 	u->w = INT_MAX;
-	memset(u->next, '\0', (k + 1) * sizeof(Node*));
+	memset(u->next, '\0', (k + 1) * sizeof(Link));
 	return u;
 }
 
-template<class T>
-void WSSkiplist<T>::deleteNode(Node *u) {
-	free(u);
+template<class T, bool Inline>
+void WSSkiplist<T,Inline>::deleteNode(Node *u) {
+	arena.free(u);
 }
 
-template<class T>
-void WSSkiplist<T>::rebuild(int i) {
+template<class T, bool Inline>
+void WSSkiplist<T,Inline>::rebuild(int i) {
 
 	rebuild_freqs[i]++;
+	double start = counters.now();
+	size_t touched = 0;
 
 	// compute working-set numbers of relevant nodes
 	Node *u = sentinel->qnext;
@@ -153,23 +209,24 @@ void WSSkiplist<T>::rebuild(int i) {
 
 	for (int j = i - 1; j >= 0; j--) {
 		// populate L_j using L_{j+1}
+		touched += n[j+1];
 		n[j] = 0;
-		u = sentinel->next[j + 1];
+		u = sentinel->next[j + 1].node;
 		Node *prev = sentinel;
 		int w = a[j];
 		bool skipped = false;
 		while (u != NULL) {
 			if (skipped || u->w <= w) {
-				prev->next[j] = u;
+				link(prev->next[j], u);
 				prev = u;
 				n[j]++;
 				skipped = false;
 			} else {
 				skipped = true;
 			}
-			u = u->next[j + 1];
+			u = u->next[j + 1].node;
 		}
-		prev->next[j] = NULL;
+		link(prev->next[j], NULL);
 	}
 
 	// reset all working-set numbers
@@ -178,21 +235,25 @@ void WSSkiplist<T>::rebuild(int i) {
 		u->w = INT_MAX;
 		u = u->qnext;
 	}
-
+	counters.rebuilt(i, touched + 2*wmax, start);
 }
 
-template<class T>
-T WSSkiplist<T>::find(T x) {
+template<class T, bool Inline>
+T WSSkiplist<T,Inline>::find(T x) {
 	Node *blech[50]; // FIXME: fixed upper bound
+	counters.find();
 	Node *u = sentinel;
 	int c = -1, i = 0;
-	while (u->next[i] != NULL && (c = cmp(u->next[i]->x, x)) < 0)
-		u = u->next[i];
+	while (counters.touch(&u->next[i]), u->next[i].node != NULL
+			&& (counters.compare(), c = cmp(key(u->next[i]), x)) < 0)
+		u = u->next[i].node;
 	blech[i] = u;
 	if (c != 0) {
 		for (i = 1; i <= k; i++) {
-			if (u->next[i] != NULL && (c = cmp(u->next[i]->x, x)) < 0)
-				u = u->next[i];
+			counters.touch(&u->next[i]);
+			if (u->next[i].node != NULL
+					&& (counters.compare(), c = cmp(key(u->next[i]), x)) < 0)
+				u = u->next[i].node;
 			blech[i] = u;
 			if (c == 0)
 				break;
@@ -201,17 +262,18 @@ T WSSkiplist<T>::find(T x) {
 
 	// Search is done: we're going to return w->x
 	i = i > k ? k : i;
-	Node *w = u->next[i];
+	Node *w = u->next[i].node;
 	if (w == NULL)
 		return (T) NULL;  // FIXME: not portable
 
 	// Add w to lists L_0,...,L_{i-1}
 	while (i > 0) {
 		i--;
-		if (blech[i]->next[i] != w) {
+		if (blech[i]->next[i].node != w) {
+			counters.promote();
 			n[i]++;
 			w->next[i] = blech[i]->next[i];
-			blech[i]->next[i] = w;
+			link(blech[i]->next[i], w);
 		}
 	}
 
@@ -233,42 +295,58 @@ T WSSkiplist<T>::find(T x) {
 	return w->x;
 }
 
-template<class T>
-WSSkiplist<T>::~WSSkiplist() {
-	Node *prev = sentinel;
-	while (prev != NULL) {
-		Node *u = prev->next[k];
-		prev->next[k] = NULL;
-		deleteNode(prev);
-		prev = u;
-	}
+template<class T, bool Inline>
+WSSkiplist<T,Inline>::~WSSkiplist() {
+	// the arena frees all the nodes at once
 }
 
-template<class T>
-void WSSkiplist<T>::sanity() {
+template<class T, bool Inline>
+void WSSkiplist<T,Inline>::sanity() {
 	assert(n[0] <= n0max);
 	for (int i = 0; i <= k; i++) {
 		Node *u = sentinel;
 		for (int j = 0; j < n[i]; j++) {
-			assert(u == sentinel || u->x < u->next->x);
+			assert(u == sentinel || u->x < u->next[i].node->x);
 			assert(u->w == INT_MAX);
-			u = u->next[i];
+			u = u->next[i].node;
 		}
-		assert(u->next[i] == NULL);
+		assert(u->next[i].node == NULL);
+	}
+}
+
+template<class T, bool Inline>
+Stats WSSkiplist<T,Inline>::stats() {
+	Stats s;
+	s.structure = "WSSkiplist";
+	s.n = n[k];
+	s.k = k;
+	s.eps = eps;
+	s.bytesUsed = bytesUsed();
+	s.levels.resize(k + 1);
+	for (int i = 0; i <= k; i++) {
+		LevelStats &l = s.levels[i];
+		l.size = n[i];
+		l.maxSize = a[i];
+		l.bound = (i == 0) ? n0max : b[i];
+		l.rebuilds = rebuild_freqs[i];
+		l.touched = 0;
+		l.seconds = 0;
 	}
+	counters.fill(s);
+	return s;
 }
 
-template<class T>
-void WSSkiplist<T>::printOn(std::ostream &out) {
+template<class T, bool Inline>
+void WSSkiplist<T,Inline>::printOn(std::ostream &out) {
 	const int max_print = 50;
 	cout << "WSSkiplist: n = " << n[k] << ", k = " << k << endl;
 	for (int i = 0; i <= k; i++) {
 		cout << "L(" << i << "): ";
 		if (n[k] <= max_print) {
-			Node *u = sentinel->next[i];
+			Node *u = sentinel->next[i].node;
 			for (int j = 0; j < n[i]; j++) {
 				cout << u->x << ",";
-				u = u->next[i];
+				u = u->next[i].node;
 			}
 			assert(u == NULL);
 		}
@@ -286,8 +364,8 @@ void WSSkiplist<T>::printOn(std::ostream &out) {
 	}
 }
 
-template<class T>
-ostream& operator<<(ostream &out, WSSkiplist<T> &sl) {
+template<class T, bool Inline>
+ostream& operator<<(ostream &out, WSSkiplist<T,Inline> &sl) {
 	sl.printOn(out);
 	return out;
 }